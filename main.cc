@@ -7,10 +7,21 @@
 #include <libgen.h>
 #include <string.h>
 
+#include <string>
+#include <vector>
+
+#include "parallel_runner.h"
+
 const char *testdata_dir;
 
 int main(int argc, char* argv[]) {
+  std::vector<std::string> args(argv, argv + argc);
   ::testing::InitGoogleTest(&argc, argv);
   testdata_dir = "/system/data/testdata";
+  ParallelRunnerOptions options;
+  if (!ParseParallelRunnerFlags(&argc, argv, &options))
+    return 1;
+  if (options.jobs > 0 && !::testing::GTEST_FLAG(list_tests))
+    return RunTestsInParallel(args, options);
   return RUN_ALL_TESTS();
 }
@@ -0,0 +1,467 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "parallel_runner.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const char kJobsFlag[] = "--jobs";
+const char kTimingFileFlag[] = "--timing_file=";
+
+// Test cases that measure time or memory.  They run one at a time, after
+// all the other tests, so that other tests don't skew their numbers.  Add
+// new benchmark suites here; test cases named like benchmarks but missing
+// from this list get a warning.
+const char* const kBenchmarkTestCases[] = {
+  "LibmAccuracyBenchTests",
+  "MallocThreadsStressTests",
+  "ThreadLifecycleBenchTests",
+  "TlsAccessBenchTests",
+};
+
+struct TestRun {
+  std::string name;
+  // Wall time of the last run from the timing file, or -1 if unknown.
+  double previous_seconds;
+  pid_t pid;
+  FILE* output;
+  double start;
+  int status;
+  double wall_seconds;
+  double cpu_seconds;
+  long max_rss_kib;
+};
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double TimevalSeconds(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+bool StartsWith(const std::string& s, const char* prefix) {
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Matches gtest's own rule: the test case or the test name starts with
+// DISABLED_, after any parameterized test prefix.
+bool IsDisabled(const std::string& test_case, const std::string& test) {
+  return StartsWith(test_case, "DISABLED_") ||
+         test_case.find("/DISABLED_") != std::string::npos ||
+         StartsWith(test, "DISABLED_");
+}
+
+// The test case of a "Case.Test" name, without the prefix of a
+// parameterized test.
+std::string TestCaseOf(const std::string& name) {
+  std::string test_case = name.substr(0, name.find('.'));
+  size_t slash = test_case.rfind('/');
+  return slash == std::string::npos ? test_case : test_case.substr(slash + 1);
+}
+
+bool IsBenchmark(const std::string& name) {
+  std::string test_case = TestCaseOf(name);
+  for (size_t i = 0;
+       i < sizeof(kBenchmarkTestCases) / sizeof(kBenchmarkTestCases[0]); i++) {
+    if (test_case == kBenchmarkTestCases[i])
+      return true;
+  }
+  return false;
+}
+
+bool LooksLikeBenchmark(const std::string& name) {
+  std::string test_case = TestCaseOf(name);
+  return test_case.find("Bench") != std::string::npos ||
+         test_case.find("Stress") != std::string::npos;
+}
+
+// A temporary file that the children started for other tests don't
+// inherit.
+FILE* CloexecTmpfile() {
+  FILE* file = tmpfile();
+  if (file != NULL && fcntl(fileno(file), F_SETFD, FD_CLOEXEC) != 0) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+// Each line of the timing file is "<seconds> <test name>".
+std::map<std::string, double> ReadTimings(const std::string& path) {
+  std::map<std::string, double> timings;
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL)
+    return timings;
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    double seconds;
+    char name[1024];
+    if (sscanf(line, "%lf %1023s", &seconds, name) == 2)
+      timings[name] = seconds;
+  }
+  fclose(file);
+  return timings;
+}
+
+// Writes to a temporary file and renames it, so that an interrupted run
+// does not lose the history.
+void WriteTimings(const std::string& path,
+                  const std::map<std::string, double>& timings) {
+  std::string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot write timing file %s: %s\n", tmp_path.c_str(),
+            strerror(errno));
+    return;
+  }
+  for (std::map<std::string, double>::const_iterator it = timings.begin();
+       it != timings.end(); ++it) {
+    fprintf(file, "%.3f %s\n", it->second, it->first.c_str());
+  }
+  if (fclose(file) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    fprintf(stderr, "Cannot write timing file %s: %s\n", path.c_str(),
+            strerror(errno));
+  }
+}
+
+// Starts this binary again with args, with stdout and stderr redirected to
+// output_fd.  /proc/self/exe is tried first, since argv[0] need not be a
+// path to the binary; args[0] is still what the child sees as argv[0].
+// Returns the child's pid, or -1 with errno set if fork() failed.
+pid_t SpawnChild(const std::vector<std::string>& args, int output_fd) {
+  // Don't let the child inherit, and later print, our buffered output.
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  dup2(output_fd, STDOUT_FILENO);
+  dup2(output_fd, STDERR_FILENO);
+  std::vector<char*> argv;
+  for (size_t i = 0; i < args.size(); i++)
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+  argv.push_back(NULL);
+  execv("/proc/self/exe", &argv[0]);
+  execvp(argv[0], &argv[0]);
+  fprintf(stderr, "Cannot run %s: %s\n", argv[0], strerror(errno));
+  _exit(127);
+}
+
+// Lists the tests that the given arguments select by running the binary
+// with --gtest_list_tests, which applies the filter the same way as a real
+// run.  The output has a line per test case, "Case.", followed by a line
+// per test, "  Test", each optionally followed by "  # <parameter>".
+// Disabled tests are listed too, so they are dropped here unless
+// --gtest_also_run_disabled_tests was given.
+bool ListTests(const std::vector<std::string>& args,
+               std::vector<std::string>* tests) {
+  std::vector<std::string> list_args(args);
+  list_args.push_back("--gtest_list_tests");
+  FILE* output = CloexecTmpfile();
+  if (output == NULL)
+    return false;
+  pid_t pid = SpawnChild(list_args, fileno(output));
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fclose(output);
+    return false;
+  }
+  rewind(output);
+  bool run_disabled = ::testing::GTEST_FLAG(also_run_disabled_tests);
+  std::string test_case;
+  char line[1024];
+  while (fgets(line, sizeof(line), output) != NULL) {
+    if (line[0] != ' ') {
+      test_case.assign(line, strcspn(line, " \n"));
+      continue;
+    }
+    std::string test(line + 2, strcspn(line + 2, " \n"));
+    if (!run_disabled && IsDisabled(test_case, test))
+      continue;
+    tests->push_back(test_case + test);
+  }
+  fclose(output);
+  return true;
+}
+
+void CopyOutput(FILE* output) {
+  rewind(output);
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), output)) > 0)
+    fwrite(buffer, 1, size, stdout);
+  fclose(output);
+}
+
+bool Passed(const TestRun& run) {
+  return WIFEXITED(run.status) && WEXITSTATUS(run.status) == 0;
+}
+
+std::string Status(const TestRun& run) {
+  if (WIFSIGNALED(run.status)) {
+    char status[32];
+    snprintf(status, sizeof(status), "CRASHED(%d)", WTERMSIG(run.status));
+    return status;
+  }
+  return Passed(run) ? "PASSED" : "FAILED";
+}
+
+bool LongerWallTime(const TestRun* a, const TestRun* b) {
+  return a->wall_seconds > b->wall_seconds;
+}
+
+void PrintReport(const std::vector<TestRun>& runs, int jobs,
+                 double elapsed) {
+  std::vector<const TestRun*> sorted;
+  double total_wall = 0;
+  double total_cpu = 0;
+  int failures = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    sorted.push_back(&runs[i]);
+    total_wall += runs[i].wall_seconds;
+    total_cpu += runs[i].cpu_seconds;
+    if (!Passed(runs[i]))
+      failures++;
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), LongerWallTime);
+
+  printf("\nTest report: %zu tests in %.2f s with %d jobs "
+         "(%.2f s wall, %.2f s CPU summed over tests)\n",
+         runs.size(), elapsed, jobs, total_wall, total_cpu);
+  printf("%-12s %9s %9s %8s %9s %11s  %s\n", "STATUS", "WALL(s)", "PREV(s)",
+         "CHANGE", "CPU(s)", "MAXRSS(KiB)", "TEST");
+  for (size_t i = 0; i < sorted.size(); i++) {
+    const TestRun& run = *sorted[i];
+    char previous[16] = "-";
+    char change[16] = "-";
+    if (run.previous_seconds >= 0) {
+      snprintf(previous, sizeof(previous), "%.3f", run.previous_seconds);
+      if (run.previous_seconds > 0) {
+        snprintf(change, sizeof(change), "%+.0f%%",
+                 100 * (run.wall_seconds / run.previous_seconds - 1));
+      }
+    }
+    printf("%-12s %9.3f %9s %8s %9.3f %11ld  %s\n", Status(run).c_str(),
+           run.wall_seconds, previous, change, run.cpu_seconds,
+           run.max_rss_kib, run.name.c_str());
+  }
+  if (failures == 0) {
+    printf("All %zu tests passed.\n", runs.size());
+    return;
+  }
+  printf("%d of %zu tests failed:\n", failures, runs.size());
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (!Passed(runs[i]))
+      printf("  %s %s\n", Status(runs[i]).c_str(), runs[i].name.c_str());
+  }
+}
+
+}  // namespace
+
+bool ParseParallelRunnerFlags(int* argc, char** argv,
+                              ParallelRunnerOptions* options) {
+  int out = 1;
+  for (int i = 1; i < *argc; i++) {
+    std::string arg(argv[i]);
+    if (arg == kJobsFlag) {
+      long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+      options->jobs = nprocs > 1 ? nprocs : 1;
+    } else if (StartsWith(arg, kJobsFlag) && arg[strlen(kJobsFlag)] == '=') {
+      const char* value = arg.c_str() + strlen(kJobsFlag) + 1;
+      char* end;
+      errno = 0;
+      long jobs = strtol(value, &end, 10);
+      if (end == value || *end != '\0' || errno != 0 || jobs < 1 ||
+          jobs > INT_MAX) {
+        fprintf(stderr, "Invalid %s: the number of jobs must be a positive "
+                "integer.\n", argv[i]);
+        return false;
+      }
+      options->jobs = jobs;
+    } else if (StartsWith(arg, kTimingFileFlag)) {
+      options->timing_file = arg.substr(strlen(kTimingFileFlag));
+    } else {
+      argv[out++] = argv[i];
+    }
+  }
+  *argc = out;
+  argv[out] = NULL;
+  return true;
+}
+
+int RunTestsInParallel(const std::vector<std::string>& args,
+                       const ParallelRunnerOptions& options) {
+  // Arguments for the children: the original ones without our flags.
+  // --gtest_output is dropped too, since the children would all write the
+  // same file; the report below takes its place.
+  std::vector<std::string> child_args;
+  for (size_t i = 0; i < args.size(); i++) {
+    const std::string& arg = args[i];
+    if (i > 0 && (StartsWith(arg, kJobsFlag) ||
+                  StartsWith(arg, kTimingFileFlag) ||
+                  StartsWith(arg, "--gtest_output")))
+      continue;
+    child_args.push_back(arg);
+  }
+
+  std::vector<std::string> names;
+  if (!ListTests(child_args, &names)) {
+    // fork() is not available everywhere, e.g. on Fuchsia.
+    fprintf(stderr, "WARNING: --jobs is ignored: cannot start this binary "
+            "in a child process, which needs fork() and exec().  Running "
+            "the tests one at a time in this process.\n");
+    return RUN_ALL_TESTS();
+  }
+
+  std::map<std::string, double> timings;
+  if (!options.timing_file.empty())
+    timings = ReadTimings(options.timing_file);
+
+  // Longest first, by the last run's time.  Tests without history go
+  // first, since they may well be the longest.  Benchmarks go after all the
+  // other tests, in the same order among themselves.
+  std::vector<TestRun> runs(names.size());
+  std::vector<std::pair<double, size_t> > order;
+  for (size_t i = 0; i < names.size(); i++) {
+    runs[i].name = names[i];
+    std::map<std::string, double>::const_iterator it = timings.find(names[i]);
+    runs[i].previous_seconds = it != timings.end() ? it->second : -1;
+    double key = it != timings.end() ? it->second : 1e30;
+    // Negated so that sorting ascending puts the longest first, and ties
+    // keep the listing order.
+    order.push_back(std::make_pair(-key, i));
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<std::pair<double, size_t> > benchmarks;
+  std::vector<std::pair<double, size_t> > tests;
+  std::set<std::string> unlisted;
+  for (size_t i = 0; i < order.size(); i++) {
+    const std::string& name = names[order[i].second];
+    if (IsBenchmark(name)) {
+      benchmarks.push_back(order[i]);
+      continue;
+    }
+    if (LooksLikeBenchmark(name) && unlisted.insert(TestCaseOf(name)).second) {
+      fprintf(stderr, "WARNING: %s looks like a benchmark but is not in "
+              "kBenchmarkTestCases in parallel_runner.cc, so it runs "
+              "alongside other tests.\n", TestCaseOf(name).c_str());
+    }
+    tests.push_back(order[i]);
+  }
+  order = tests;
+  order.insert(order.end(), benchmarks.begin(), benchmarks.end());
+
+  // Remove the filter from the children's arguments, since each gets its
+  // own.
+  std::vector<std::string> base_args;
+  for (size_t i = 0; i < child_args.size(); i++) {
+    if (i == 0 || !StartsWith(child_args[i], "--gtest_filter"))
+      base_args.push_back(child_args[i]);
+  }
+
+  printf("Running %zu tests with %d jobs, then %zu benchmarks one at a "
+         "time\n", tests.size(), options.jobs, benchmarks.size());
+  double start = NowSeconds();
+  std::map<pid_t, TestRun*> running;
+  size_t next = 0;
+  while (next < order.size() || !running.empty()) {
+    while (next < order.size()) {
+      // A benchmark waits for every other test to finish, and nothing else
+      // starts while it runs.
+      bool benchmark = next >= tests.size();
+      if ((int)running.size() >= (benchmark ? 1 : options.jobs))
+        break;
+      TestRun* run = &runs[order[next++].second];
+      std::vector<std::string> test_args(base_args);
+      test_args.push_back("--gtest_filter=" + run->name);
+      run->output = CloexecTmpfile();
+      if (run->output == NULL) {
+        perror("tmpfile");
+        return 1;
+      }
+      run->start = NowSeconds();
+      run->pid = SpawnChild(test_args, fileno(run->output));
+      if (run->pid < 0) {
+        perror("fork");
+        return 1;
+      }
+      running[run->pid] = run;
+    }
+
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("wait4");
+      return 1;
+    }
+    std::map<pid_t, TestRun*>::iterator it = running.find(pid);
+    if (it == running.end())
+      continue;
+    TestRun* run = it->second;
+    running.erase(it);
+    run->status = status;
+    run->wall_seconds = NowSeconds() - run->start;
+    run->cpu_seconds =
+        TimevalSeconds(usage.ru_utime) + TimevalSeconds(usage.ru_stime);
+    run->max_rss_kib = usage.ru_maxrss;
+    // Print each test's output in one piece as it finishes.
+    CopyOutput(run->output);
+    if (WIFSIGNALED(status)) {
+      printf("[  CRASHED ] %s (signal %d)\n", run->name.c_str(),
+             WTERMSIG(status));
+    }
+  }
+  double elapsed = NowSeconds() - start;
+
+  PrintReport(runs, options.jobs, elapsed);
+
+  if (!options.timing_file.empty()) {
+    // Keep the history of the tests that the filter left out of this run,
+    // but not of tests the binary no longer has.
+    std::map<std::string, double> kept;
+    std::vector<std::string> all_names;
+    if (ListTests(base_args, &all_names)) {
+      for (size_t i = 0; i < all_names.size(); i++) {
+        std::map<std::string, double>::const_iterator it =
+            timings.find(all_names[i]);
+        if (it != timings.end())
+          kept[it->first] = it->second;
+      }
+    }
+    for (size_t i = 0; i < runs.size(); i++)
+      kept[runs[i].name] = runs[i].wall_seconds;
+    WriteTimings(options.timing_file, kept);
+  }
+
+  for (size_t i = 0; i < runs.size(); i++) {
+    if (!Passed(runs[i]))
+      return 1;
+  }
+  return 0;
+}
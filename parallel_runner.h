@@ -0,0 +1,42 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef LIBC_TESTS_PARALLEL_RUNNER_H_
+#define LIBC_TESTS_PARALLEL_RUNNER_H_
+
+#include <string>
+#include <vector>
+
+struct ParallelRunnerOptions {
+  ParallelRunnerOptions() : jobs(0) {}
+  // Number of tests to run at once.  0 runs RUN_ALL_TESTS() in this
+  // process as usual.
+  int jobs;
+  // Durations of earlier runs, read to order the tests and rewritten with
+  // this run's durations.  Empty to run without history.
+  std::string timing_file;
+};
+
+// Removes --jobs[=N] and --timing_file=PATH from argv.  --jobs without a
+// value means one job per processor.  Call after InitGoogleTest(), which
+// removes the gtest flags.  Prints an error and returns false if N is not a
+// positive integer.
+bool ParseParallelRunnerFlags(int* argc, char** argv,
+                              ParallelRunnerOptions* options);
+
+// Runs each test selected by the gtest flags in its own child process,
+// running this binary again with --gtest_filter, options.jobs at a time and
+// the longest first.  Benchmarks, the test cases listed in
+// kBenchmarkTestCases in parallel_runner.cc, run afterwards one at a time,
+// so that other tests don't skew their measurements.  A crash only fails
+// the test that crashed.  If child processes cannot be started, as on
+// Fuchsia, which has no fork(), warns and runs RUN_ALL_TESTS() in this
+// process instead.  Prints each test's output when it finishes and then a
+// report of every test's wall time, CPU time and max RSS.  args are the
+// arguments main() got, before InitGoogleTest() removed the gtest flags.
+// Returns the exit status for main(): 0 if all tests passed.
+int RunTestsInParallel(const std::vector<std::string>& args,
+                       const ParallelRunnerOptions& options);
+
+#endif  // LIBC_TESTS_PARALLEL_RUNNER_H_
@@ -56,15 +56,24 @@ uint64_t next_seq(uint64_t num) {
  * the initialized memory will look like this (words):
  * [N, s1, s2, s3 ...]
  * s1 <- (addr % 1000). s2 <- next_seq(s1). s3 <- next_seq(s2), etc...
+ * fill_memory returns false for numwords = 0 instead of asserting, so that
+ * threads other than the main one can use it.
  */
-void init_memory(void *addr, uint32_t numwords) {
-  ASSERT_GE(numwords, (uint32_t)1);
+bool fill_memory(void *addr, uint32_t numwords) {
+  if (numwords < 1)
+    return false;
   uint64_t *wordaddr = (uint64_t*)addr;
   wordaddr[0] = numwords;
   for (uint32_t i = 1; i < numwords; i++) {
     wordaddr[i] = (i == 1) ? (((uint64_t)addr) % 1000)
                            : next_seq(wordaddr[i - 1]);
   }
+  return true;
+}
+
+void init_memory(void *addr, uint32_t numwords) {
+  ASSERT_GE(numwords, (uint32_t)1);
+  fill_memory(addr, numwords);
 }
 
 /* Verify that memory is initialized as expected from init_memory */
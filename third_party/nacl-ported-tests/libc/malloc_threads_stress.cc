@@ -0,0 +1,479 @@
+/*
+ * Copyright 2016 The Fuchsia Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Multithreaded companion to TestMallocCallocReallocFree. Runs the same
+ * init_memory/verify_memory workload across 1..N threads and reports
+ * throughput, per-call latency, peak RSS and RSS growth for each thread
+ * count, so that allocator scaling and fragmentation can be compared between
+ * libc builds.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define WSIZE sizeof(uint64_t)
+
+#include "gtest/gtest.h"
+
+/* Defined in malloc_realloc_calloc_free.cc */
+uint64_t next_seq(uint64_t num);
+bool fill_memory(void *addr, uint32_t numwords);
+
+namespace {
+
+/* Fixed so that every run and every libc build sees the same sizes. */
+const unsigned kSeed = 1;
+/* Allocations live at once in each thread of the local workload. */
+const uint32_t kLiveAllocs = 64;
+const uint32_t kRounds = 256;
+/* Allocations handed to the next thread in each producer/consumer round. */
+const uint32_t kBatchSize = 64;
+const uint32_t kChains = 512;
+const uint32_t kChainSteps = 12;
+/* How often the peak RSS of a run is sampled. */
+const useconds_t kRssSampleMicroseconds = 1000;
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Size distribution skewed towards small size classes, the way server
+ * workloads are: 80% up to 256 bytes, 15% up to 4 KiB, 4% up to 128 KiB and
+ * 1% up to the 512 KiB that run_allocation_test uses.
+ */
+uint32_t skewed_numwords(unsigned *seed) {
+  uint32_t bucket = rand_r(seed) % 100;
+  uint32_t r = rand_r(seed);
+  if (bucket < 80)
+    return 1 + r % 32;
+  if (bucket < 95)
+    return 33 + r % (512 - 32);
+  if (bucket < 99)
+    return 513 + r % ((16 << 10) - 512);
+  return 1 + r % (2 << 15);
+}
+
+/*
+ * Verify a buffer that fill_memory filled and realloc may since have moved.
+ * The contents are derived from the original address; first_seq is that
+ * address % 1000. Returns false on a mismatch, since verify_memory's gtest
+ * assertions don't work on the worker threads.
+ */
+bool moved_memory_ok(void *addr, uint64_t first_seq, uint32_t numwords) {
+  uint64_t *wordaddr = (uint64_t*)addr;
+  if (wordaddr[0] != (uint64_t)numwords)
+    return false;
+  if (numwords > 1 && wordaddr[1] != first_seq)
+    return false;
+  for (uint32_t i = 2; i < numwords; i++) {
+    if (wordaddr[i] != next_seq(wordaddr[i - 1]))
+      return false;
+  }
+  return true;
+}
+
+/* verify_memory for a buffer that has not moved since fill_memory. */
+bool memory_ok(void *addr) {
+  uint64_t numwords = *(uint64_t*)addr;
+  if (numwords < 1 || numwords > UINT32_MAX)
+    return false;
+  return moved_memory_ok(addr, (uint64_t)addr % 1000, (uint32_t)numwords);
+}
+
+/* A batch of allocations handed from one thread to the next. */
+struct BatchQueue {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<std::vector<void*> > batches;
+};
+
+typedef enum {
+  LOCAL_ALLOC_FREE, CROSS_THREAD_FREE, REALLOC_CHAINS
+} Workload;
+
+struct ThreadState {
+  Workload workload;
+  unsigned seed;
+  BatchQueue *incoming;
+  BatchQueue *outgoing;
+  /* Every queue of the run, and whether any thread of the run has failed. */
+  std::vector<BatchQueue> *queues;
+  volatile int *failed;
+  /* Why this thread stopped early, or empty. */
+  std::string failure;
+  /* Latency of every allocator call made by this thread, in ns. */
+  std::vector<uint32_t> latencies;
+};
+
+class MallocThreadsStressTests : public ::testing::Test {
+ protected:
+
+  MallocThreadsStressTests() {
+    // You can do set-up work for each test here.
+  }
+
+  ~MallocThreadsStressTests() override {
+  }
+
+
+  void SetUp() override {
+  }
+
+  void TearDown() override {
+  }
+
+  void run_workload(Workload workload, const char *name);
+};
+
+/*
+ * gtest assertions on a worker thread only return from the function they are
+ * in, and a worker that returns early leaves the next one waiting for its
+ * batch. So workers record why they failed, tell the other workers to stop
+ * and wake any that are waiting; the main thread asserts after the join.
+ */
+void stop_workers(ThreadState *state, const char *failure) {
+  state->failure = failure;
+  __sync_fetch_and_or(state->failed, 1);
+  for (size_t i = 0; i < state->queues->size(); i++) {
+    BatchQueue *queue = &(*state->queues)[i];
+    pthread_mutex_lock(&queue->mutex);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+  }
+}
+
+bool workers_stopped(ThreadState *state) {
+  return *state->failed != 0;
+}
+
+void *timed_malloc(ThreadState *state, size_t size) {
+  uint64_t start = now_ns();
+  void *addr = malloc(size);
+  state->latencies.push_back(now_ns() - start);
+  return addr;
+}
+
+void *timed_realloc(ThreadState *state, void *ptr, size_t size) {
+  uint64_t start = now_ns();
+  void *addr = realloc(ptr, size);
+  state->latencies.push_back(now_ns() - start);
+  return addr;
+}
+
+void timed_free(ThreadState *state, void *ptr) {
+  uint64_t start = now_ns();
+  free(ptr);
+  state->latencies.push_back(now_ns() - start);
+}
+
+/* run_allocation_test with a per-thread seed and a skewed size mix. */
+void run_local_alloc_free(ThreadState *state) {
+  void *table[kLiveAllocs];
+  for (uint32_t round = 0; round < kRounds; round++) {
+    if (workers_stopped(state))
+      return;
+    for (uint32_t i = 0; i < kLiveAllocs; i++) {
+      uint32_t numwords = skewed_numwords(&state->seed);
+      void *addr = timed_malloc(state, WSIZE * numwords);
+      if (addr == NULL) {
+        for (uint32_t j = 0; j < i; j++)
+          free(table[j]);
+        stop_workers(state, "malloc returned NULL");
+        return;
+      }
+      fill_memory(addr, numwords);
+      table[i] = addr;
+    }
+    for (uint32_t i = 0; i < kLiveAllocs; i++) {
+      if (!memory_ok(table[i])) {
+        for (uint32_t j = i; j < kLiveAllocs; j++)
+          free(table[j]);
+        stop_workers(state, "a buffer's contents changed before free");
+        return;
+      }
+      timed_free(state, table[i]);
+    }
+  }
+}
+
+/*
+ * Each thread allocates a batch and hands it to the next thread, which
+ * verifies and frees it. Every thread pushes before it pops, so each round
+ * every queue receives exactly one batch. A thread that fails stops the
+ * others, and batches left in the queues are freed after the join.
+ */
+void run_cross_thread_free(ThreadState *state) {
+  for (uint32_t round = 0; round < kRounds; round++) {
+    if (workers_stopped(state))
+      return;
+    std::vector<void*> batch;
+    for (uint32_t i = 0; i < kBatchSize; i++) {
+      uint32_t numwords = skewed_numwords(&state->seed);
+      void *addr = timed_malloc(state, WSIZE * numwords);
+      if (addr == NULL) {
+        for (size_t j = 0; j < batch.size(); j++)
+          free(batch[j]);
+        stop_workers(state, "malloc returned NULL");
+        return;
+      }
+      fill_memory(addr, numwords);
+      batch.push_back(addr);
+    }
+
+    BatchQueue *out = state->outgoing;
+    pthread_mutex_lock(&out->mutex);
+    out->batches.push_back(batch);
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->mutex);
+
+    BatchQueue *in = state->incoming;
+    pthread_mutex_lock(&in->mutex);
+    while (in->batches.empty() && !workers_stopped(state))
+      pthread_cond_wait(&in->cond, &in->mutex);
+    if (in->batches.empty()) {
+      pthread_mutex_unlock(&in->mutex);
+      return;
+    }
+    batch.swap(in->batches.front());
+    in->batches.pop_front();
+    pthread_mutex_unlock(&in->mutex);
+
+    for (size_t i = 0; i < batch.size(); i++) {
+      if (!memory_ok(batch[i])) {
+        for (size_t j = i; j < batch.size(); j++)
+          free(batch[j]);
+        stop_workers(state, "a batch's contents changed on the way");
+        return;
+      }
+      timed_free(state, batch[i]);
+    }
+  }
+}
+
+/* Grow buffers by 1.5x-2x per step, checking that realloc keeps contents. */
+void run_realloc_chains(ThreadState *state) {
+  for (uint32_t chain = 0; chain < kChains; chain++) {
+    if (workers_stopped(state))
+      return;
+    uint32_t numwords = 1 + rand_r(&state->seed) % 16;
+    void *addr = timed_malloc(state, WSIZE * numwords);
+    if (addr == NULL) {
+      stop_workers(state, "malloc returned NULL");
+      return;
+    }
+    fill_memory(addr, numwords);
+    uint64_t first_seq = (uint64_t)addr % 1000;
+    for (uint32_t step = 0; step < kChainSteps; step++) {
+      uint32_t new_numwords =
+          numwords + numwords / 2 + rand_r(&state->seed) % (numwords / 2 + 1);
+      void *new_addr = timed_realloc(state, addr, WSIZE * new_numwords);
+      if (new_addr == NULL) {
+        stop_workers(state, "realloc returned NULL");
+        return;
+      }
+      if (!moved_memory_ok(new_addr, first_seq, numwords)) {
+        free(new_addr);
+        stop_workers(state, "realloc did not keep the buffer's contents");
+        return;
+      }
+      addr = new_addr;
+      numwords = new_numwords;
+      fill_memory(addr, numwords);
+      first_seq = (uint64_t)addr % 1000;
+    }
+    if (!memory_ok(addr)) {
+      free(addr);
+      stop_workers(state, "a buffer's contents changed before free");
+      return;
+    }
+    timed_free(state, addr);
+  }
+}
+
+void *stress_thread(void *arg) {
+  ThreadState *state = (ThreadState*)arg;
+  switch (state->workload) {
+    case LOCAL_ALLOC_FREE:
+      run_local_alloc_free(state);
+      break;
+    case CROSS_THREAD_FREE:
+      run_cross_thread_free(state);
+      break;
+    case REALLOC_CHAINS:
+      run_realloc_chains(state);
+      break;
+  }
+  return NULL;
+}
+
+/*
+ * Current resident set size in KiB, or -1 where /proc/self/statm does not
+ * exist. getrusage only reports the peak over the process's lifetime, which
+ * the earlier thread counts and workloads would already have set. Reads into
+ * a stack buffer, so that sampling during a run doesn't call the allocator
+ * being measured.
+ */
+long current_rss_kib() {
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return -1;
+  char buf[128];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  long size, resident;
+  if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+    return -1;
+  return resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/* Samples the RSS every kRssSampleMicroseconds until stop is set. */
+struct RssSampler {
+  volatile int stop;
+  long peak_kib;
+};
+
+void *rss_sampler_thread(void *arg) {
+  RssSampler *sampler = (RssSampler*)arg;
+  for (;;) {
+    sampler->peak_kib = std::max(sampler->peak_kib, current_rss_kib());
+    if (sampler->stop)
+      return NULL;
+    usleep(kRssSampleMicroseconds);
+  }
+}
+
+/* Allocator calls each thread times, so that latencies never grows. */
+size_t timed_calls(Workload workload) {
+  switch (workload) {
+    case LOCAL_ALLOC_FREE:
+      return kRounds * kLiveAllocs * 2;
+    case CROSS_THREAD_FREE:
+      return kRounds * kBatchSize * 2;
+    case REALLOC_CHAINS:
+      return kChains * (kChainSteps + 2);
+  }
+  return 0;
+}
+
+/*
+ * Run the workload at 1, 2, 4 ... threads up to the number of processors,
+ * and print one line of results per thread count. The peak RSS is sampled
+ * while the workers run. Every workload frees all it allocates, so the RSS
+ * growth across a run is memory that the allocator kept: fragmentation,
+ * caches and per-thread arenas.
+ */
+void MallocThreadsStressTests::run_workload(Workload workload,
+                                            const char *name) {
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t max_threads = nprocs > 1 ? nprocs : 1;
+  printf("Random seed = %u\n", kSeed);
+  std::vector<uint32_t> thread_counts;
+  for (uint32_t nthreads = 1; nthreads < max_threads; nthreads *= 2)
+    thread_counts.push_back(nthreads);
+  thread_counts.push_back(max_threads);
+
+  for (size_t t = 0; t < thread_counts.size(); t++) {
+    uint32_t nthreads = thread_counts[t];
+    std::vector<BatchQueue> queues(nthreads);
+    std::vector<ThreadState> states(nthreads);
+    std::vector<pthread_t> tids(nthreads);
+    volatile int failed = 0;
+    for (uint32_t i = 0; i < nthreads; i++) {
+      ASSERT_EQ(pthread_mutex_init(&queues[i].mutex, NULL), 0);
+      ASSERT_EQ(pthread_cond_init(&queues[i].cond, NULL), 0);
+    }
+    for (uint32_t i = 0; i < nthreads; i++) {
+      states[i].workload = workload;
+      states[i].seed = kSeed + i;
+      states[i].incoming = &queues[i];
+      states[i].outgoing = &queues[(i + 1) % nthreads];
+      states[i].queues = &queues;
+      states[i].failed = &failed;
+      states[i].latencies.reserve(timed_calls(workload));
+    }
+
+    long rss_before = current_rss_kib();
+    RssSampler sampler = { 0, rss_before };
+    pthread_t sampler_tid;
+    ASSERT_EQ(pthread_create(&sampler_tid, NULL, rss_sampler_thread, &sampler),
+              0);
+    uint64_t start = now_ns();
+    uint32_t started = 0;
+    for (; started < nthreads; started++) {
+      if (pthread_create(&tids[started], NULL, stress_thread,
+                         &states[started]) != 0) {
+        stop_workers(&states[started], "pthread_create failed");
+        break;
+      }
+    }
+    uint32_t joined = 0;
+    for (uint32_t i = 0; i < started; i++) {
+      if (pthread_join(tids[i], NULL) == 0)
+        joined++;
+    }
+    uint64_t elapsed = now_ns() - start;
+    /* The sampler uses this frame, so it is stopped before any assert. */
+    sampler.stop = 1;
+    ASSERT_EQ(pthread_join(sampler_tid, NULL), 0);
+    ASSERT_EQ(joined, started);
+    long rss_after = current_rss_kib();
+
+    std::vector<uint32_t> latencies;
+    for (uint32_t i = 0; i < nthreads; i++) {
+      latencies.insert(latencies.end(), states[i].latencies.begin(),
+                       states[i].latencies.end());
+      for (size_t b = 0; b < queues[i].batches.size(); b++) {
+        for (size_t j = 0; j < queues[i].batches[b].size(); j++)
+          free(queues[i].batches[b][j]);
+      }
+      ASSERT_EQ(pthread_cond_destroy(&queues[i].cond), 0);
+      ASSERT_EQ(pthread_mutex_destroy(&queues[i].mutex), 0);
+    }
+    for (uint32_t i = 0; i < nthreads; i++)
+      ASSERT_EQ(states[i].failure, "") << "thread " << i << " of " << nthreads;
+    ASSERT_FALSE(HasFatalFailure());
+    ASSERT_FALSE(latencies.empty());
+    size_t ops = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s threads=%u: %.0f ops/sec, p50=%u ns, p99=%u ns, "
+           "RSS before=%ld KiB, peak=%ld KiB, after=%ld KiB, "
+           "growth=%ld KiB\n",
+           name, nthreads, ops / (elapsed / 1e9), latencies[ops / 2],
+           latencies[ops * 99 / 100], rss_before, sampler.peak_kib, rss_after,
+           rss_before >= 0 && rss_after >= 0 ? rss_after - rss_before : -1);
+  }
+}
+
+} //namespace
+
+TEST_F(MallocThreadsStressTests, TestLocalAllocFree) {
+  run_workload(LOCAL_ALLOC_FREE, "LocalAllocFree");
+}
+
+TEST_F(MallocThreadsStressTests, TestCrossThreadFree) {
+  run_workload(CROSS_THREAD_FREE, "CrossThreadFree");
+}
+
+TEST_F(MallocThreadsStressTests, TestReallocChains) {
+  run_workload(REALLOC_CHAINS, "ReallocChains");
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2016 The Fuchsia Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Accuracy and speed of sin, cos, exp, log and pow in float and double,
+ * over large arrays of inputs rather than the spot values checked by
+ * sincos_test.cc and c_pow.cc. For each function and input range this
+ * reports:
+ *   - throughput: ns per element for independent calls over an array,
+ *   - latency: ns per element when each input depends on the previous
+ *     result, so calls cannot overlap,
+ *   - max and mean error in ULPs against the long double function, which
+ *     has at least 11 more bits of precision than double.
+ * and fails if the max error exceeds the bound for the function.
+ *
+ * Inputs are split into chunks that are shared out between one thread per
+ * processor. Set LIBM_BENCH_INPUTS to run more than the default number of
+ * inputs per range, e.g. 1000000000 for an exhaustive nightly run.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <limits>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const uint64_t kDefaultInputs = 1 << 20;
+const uint32_t kChunkSize = 4096;
+const uint64_t kSeed = 12345678;
+
+/* How the inputs of a range are spread between lo and hi. */
+typedef enum {
+  UNIFORM,
+  /* Uniform in log2(x), for 0 < lo < hi. */
+  LOG_UNIFORM,
+  /* As LOG_UNIFORM, with a random sign. */
+  SIGNED_LOG_UNIFORM
+} Distribution;
+
+struct InputRange {
+  Distribution distribution;
+  double lo;
+  double hi;
+};
+
+template <typename T>
+struct MathCase {
+  const char *function;
+  const char *range_name;
+  T (*unary)(T);
+  T (*binary)(T, T);
+  long double (*unary_ref)(long double);
+  long double (*binary_ref)(long double, long double);
+  InputRange x;
+  InputRange y;
+  double max_ulp;
+};
+
+struct ErrorStats {
+  uint64_t count;
+  double max_ulp;
+  double max_ulp_x;
+  double max_ulp_y;
+  double sum_ulp;
+  uint64_t throughput_ns;
+  uint64_t latency_ns;
+};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* splitmix64, so that every chunk has its own reproducible stream. */
+uint64_t next_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1). */
+double next_unit(uint64_t *state) {
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double next_input(const InputRange &range, uint64_t *state) {
+  if (range.distribution == UNIFORM)
+    return range.lo + (range.hi - range.lo) * next_unit(state);
+  double magnitude =
+      exp2(log2(range.lo) + (log2(range.hi) - log2(range.lo)) *
+           next_unit(state));
+  if (range.distribution == SIGNED_LOG_UNIFORM && (next_random(state) & 1))
+    return -magnitude;
+  return magnitude;
+}
+
+template <typename T> struct FloatBits;
+template <> struct FloatBits<float> { typedef uint32_t Type; };
+template <> struct FloatBits<double> { typedef uint64_t Type; };
+
+/*
+ * Always 0, but read through a volatile so that the compiler cannot remove
+ * the dependency it is used to create.
+ */
+volatile uint64_t g_zero_mask = 0;
+
+/*
+ * Returns x with a data dependency on prev but the same value, for the
+ * latency chain. This adds a few integer operations to each step.
+ */
+template <typename T>
+inline T chain(T x, T prev, typename FloatBits<T>::Type mask) {
+  typename FloatBits<T>::Type x_bits, prev_bits;
+  memcpy(&x_bits, &x, sizeof(x));
+  memcpy(&prev_bits, &prev, sizeof(prev));
+  x_bits |= prev_bits & mask;
+  memcpy(&x, &x_bits, sizeof(x));
+  return x;
+}
+
+/*
+ * Error of computed in units of the last place of T at ref. NaN and
+ * infinity only count as exact when they match what ref rounds to.
+ */
+template <typename T>
+double ulp_error(T computed, long double ref) {
+  T rounded = (T)ref;
+  if (isnan(ref) || isnan(computed))
+    return isnan(ref) && isnan(computed) ? 0 : INFINITY;
+  if (isinf(rounded) || isinf(computed))
+    return rounded == computed ? 0 : INFINITY;
+  int exponent = ref == 0 ? std::numeric_limits<T>::min_exponent - 1
+                          : ilogbl(ref);
+  if (exponent < std::numeric_limits<T>::min_exponent - 1)
+    exponent = std::numeric_limits<T>::min_exponent - 1;
+  long double ulp =
+      ldexpl(1.0L, exponent - (std::numeric_limits<T>::digits - 1));
+  return (double)(fabsl((long double)computed - ref) / ulp);
+}
+
+template <typename T>
+struct ShardState {
+  const MathCase<T> *math_case;
+  uint64_t num_chunks;
+  uint64_t *next_chunk;
+  ErrorStats stats;
+};
+
+template <typename T>
+void run_chunk(const MathCase<T> &c, uint64_t chunk, ErrorStats *stats) {
+  T x[kChunkSize];
+  T y[kChunkSize];
+  T result[kChunkSize];
+  uint64_t state = kSeed ^ (chunk * 0x2545f4914f6cdd1dull);
+  for (uint32_t i = 0; i < kChunkSize; i++) {
+    x[i] = (T)next_input(c.x, &state);
+    y[i] = c.binary != NULL ? (T)next_input(c.y, &state) : 0;
+  }
+
+  uint64_t start = now_ns();
+  if (c.binary != NULL) {
+    for (uint32_t i = 0; i < kChunkSize; i++)
+      result[i] = c.binary(x[i], y[i]);
+  } else {
+    for (uint32_t i = 0; i < kChunkSize; i++)
+      result[i] = c.unary(x[i]);
+  }
+  uint64_t middle = now_ns();
+  typename FloatBits<T>::Type mask =
+      (typename FloatBits<T>::Type)g_zero_mask;
+  T prev = 0;
+  if (c.binary != NULL) {
+    for (uint32_t i = 0; i < kChunkSize; i++)
+      prev = c.binary(chain(x[i], prev, mask), y[i]);
+  } else {
+    for (uint32_t i = 0; i < kChunkSize; i++)
+      prev = c.unary(chain(x[i], prev, mask));
+  }
+  uint64_t end = now_ns();
+  /* Keep the chain's last result alive. */
+  if (chain((T)0, prev, mask) != 0)
+    abort();
+  stats->throughput_ns += middle - start;
+  stats->latency_ns += end - middle;
+
+  for (uint32_t i = 0; i < kChunkSize; i++) {
+    long double ref = c.binary != NULL ? c.binary_ref(x[i], y[i])
+                                       : c.unary_ref(x[i]);
+    double ulp = ulp_error(result[i], ref);
+    if (ulp > stats->max_ulp || stats->count == 0) {
+      stats->max_ulp = ulp;
+      stats->max_ulp_x = x[i];
+      stats->max_ulp_y = y[i];
+    }
+    stats->sum_ulp += ulp;
+    stats->count++;
+  }
+}
+
+template <typename T>
+void *shard_thread(void *arg) {
+  ShardState<T> *shard = (ShardState<T>*)arg;
+  while (true) {
+    uint64_t chunk = __sync_fetch_and_add(shard->next_chunk, 1);
+    if (chunk >= shard->num_chunks)
+      break;
+    run_chunk(*shard->math_case, chunk, &shard->stats);
+  }
+  return NULL;
+}
+
+uint64_t num_inputs() {
+  const char *env = getenv("LIBM_BENCH_INPUTS");
+  if (env != NULL) {
+    uint64_t inputs = strtoull(env, NULL, 10);
+    if (inputs > 0)
+      return inputs;
+  }
+  return kDefaultInputs;
+}
+
+class LibmAccuracyBenchTests : public ::testing::Test {
+ protected:
+
+  LibmAccuracyBenchTests() {
+    // You can do set-up work for each test here.
+  }
+
+  ~LibmAccuracyBenchTests() override {
+  }
+
+
+  void SetUp() override {
+  }
+
+  void TearDown() override {
+  }
+
+  template <typename T>
+  void run_cases(const char *type_name, const MathCase<T> *cases,
+                 size_t num_cases);
+};
+
+} //namespace
+
+template <typename T>
+void LibmAccuracyBenchTests::run_cases(const char *type_name,
+                                       const MathCase<T> *cases,
+                                       size_t num_cases) {
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = nprocs > 1 ? nprocs : 1;
+  uint64_t num_chunks = (num_inputs() + kChunkSize - 1) / kChunkSize;
+  printf("%d threads, %llu inputs per range\n", nthreads,
+         (unsigned long long)(num_chunks * kChunkSize));
+  /*
+   * Where long double is no wider than T, e.g. double on ARM32, the
+   * reference is no better than the function under test.
+   */
+  bool check_errors = std::numeric_limits<long double>::digits >=
+                      std::numeric_limits<T>::digits + 8;
+  if (!check_errors)
+    printf("long double is too narrow to check %s errors\n", type_name);
+
+  for (size_t c = 0; c < num_cases; c++) {
+    uint64_t next_chunk = 0;
+    std::vector<ShardState<T> > shards(nthreads);
+    std::vector<pthread_t> tids(nthreads);
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+      shards[i].math_case = &cases[c];
+      shards[i].num_chunks = num_chunks;
+      shards[i].next_chunk = &next_chunk;
+      memset(&shards[i].stats, 0, sizeof(shards[i].stats));
+      ASSERT_EQ(pthread_create(&tids[i], NULL, shard_thread<T>, &shards[i]),
+                0);
+    }
+    for (int i = 0; i < nthreads; i++)
+      ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    ErrorStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nthreads; i++) {
+      const ErrorStats &s = shards[i].stats;
+      if (s.count == 0)
+        continue;
+      if (total.count == 0 || s.max_ulp > total.max_ulp) {
+        total.max_ulp = s.max_ulp;
+        total.max_ulp_x = s.max_ulp_x;
+        total.max_ulp_y = s.max_ulp_y;
+      }
+      total.count += s.count;
+      total.sum_ulp += s.sum_ulp;
+      total.throughput_ns += s.throughput_ns;
+      total.latency_ns += s.latency_ns;
+    }
+    ASSERT_EQ(total.count, num_chunks * kChunkSize);
+
+    const MathCase<T> &mc = cases[c];
+    printf("%s %s %s: throughput=%.2f ns/elem, latency=%.2f ns/elem, "
+           "max=%.3f ulp, mean=%.4f ulp (%.1f sec)\n",
+           mc.function, type_name, mc.range_name,
+           (double)total.throughput_ns / total.count,
+           (double)total.latency_ns / total.count, total.max_ulp,
+           total.sum_ulp / total.count, elapsed);
+    if (!check_errors)
+      continue;
+    if (mc.binary != NULL) {
+      EXPECT_LE(total.max_ulp, mc.max_ulp)
+          << mc.function << "(" << total.max_ulp_x << ", "
+          << total.max_ulp_y << ") in " << type_name << " " << mc.range_name;
+    } else {
+      EXPECT_LE(total.max_ulp, mc.max_ulp)
+          << mc.function << "(" << total.max_ulp_x << ") in " << type_name
+          << " " << mc.range_name;
+    }
+  }
+}
+
+/*
+ * Wrappers so that every case has the same signature, whatever overloads
+ * <math.h> declares.
+ */
+float sin_f(float x) { return sinf(x); }
+float cos_f(float x) { return cosf(x); }
+float exp_f(float x) { return expf(x); }
+float log_f(float x) { return logf(x); }
+float pow_f(float x, float y) { return powf(x, y); }
+double sin_d(double x) { return sin(x); }
+double cos_d(double x) { return cos(x); }
+double exp_d(double x) { return exp(x); }
+double log_d(double x) { return log(x); }
+double pow_d(double x, double y) { return pow(x, y); }
+long double sin_ref(long double x) { return sinl(x); }
+long double cos_ref(long double x) { return cosl(x); }
+long double exp_ref(long double x) { return expl(x); }
+long double log_ref(long double x) { return logl(x); }
+long double pow_ref(long double x, long double y) { return powl(x, y); }
+
+/*
+ * "random" ranges are where most calls land; the others are where
+ * implementations usually lose accuracy: large arguments needing careful
+ * argument reduction, results near overflow and underflow, and log and pow
+ * close to 1.
+ */
+#define UNARY_CASE(name, range, fn, x, max_ulp) \
+  { #name, range, fn, NULL, name##_ref, NULL, x, { UNIFORM, 0, 0 }, max_ulp }
+#define BINARY_CASE(name, range, fn, x, y, max_ulp) \
+  { #name, range, NULL, fn, NULL, name##_ref, x, y, max_ulp }
+
+TEST_F(LibmAccuracyBenchTests, TestFloat) {
+  const MathCase<float> cases[] = {
+    UNARY_CASE(sin, "random", sin_f, (InputRange{ UNIFORM, -M_PI, M_PI }), 1),
+    UNARY_CASE(sin, "large", sin_f,
+               (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e30 }), 1),
+    UNARY_CASE(cos, "random", cos_f, (InputRange{ UNIFORM, -M_PI, M_PI }), 1),
+    UNARY_CASE(cos, "large", cos_f,
+               (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e30 }), 1),
+    UNARY_CASE(exp, "random", exp_f, (InputRange{ UNIFORM, -10, 10 }), 1),
+    UNARY_CASE(exp, "overflow", exp_f, (InputRange{ UNIFORM, 80, 89 }), 1),
+    UNARY_CASE(exp, "subnormal", exp_f,
+               (InputRange{ UNIFORM, -104, -87 }), 1),
+    UNARY_CASE(log, "random", log_f,
+               (InputRange{ LOG_UNIFORM, 1e-38, 1e38 }), 1),
+    UNARY_CASE(log, "near_one", log_f,
+               (InputRange{ UNIFORM, 1 - 1.0 / 1024, 1 + 1.0 / 1024 }), 1),
+    BINARY_CASE(pow, "random", pow_f, (InputRange{ UNIFORM, 0, 4 }),
+                (InputRange{ UNIFORM, -30, 30 }), 1),
+    BINARY_CASE(pow, "near_one", pow_f,
+                (InputRange{ UNIFORM, 1 - 1.0 / 4096, 1 + 1.0 / 4096 }),
+                (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e6 }), 1),
+  };
+  run_cases("float", cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+TEST_F(LibmAccuracyBenchTests, TestDouble) {
+  const MathCase<double> cases[] = {
+    UNARY_CASE(sin, "random", sin_d, (InputRange{ UNIFORM, -M_PI, M_PI }), 1),
+    UNARY_CASE(sin, "large", sin_d,
+               (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e300 }), 1),
+    UNARY_CASE(cos, "random", cos_d, (InputRange{ UNIFORM, -M_PI, M_PI }), 1),
+    UNARY_CASE(cos, "large", cos_d,
+               (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e300 }), 1),
+    UNARY_CASE(exp, "random", exp_d, (InputRange{ UNIFORM, -10, 10 }), 1),
+    UNARY_CASE(exp, "overflow", exp_d, (InputRange{ UNIFORM, 700, 710 }), 1),
+    UNARY_CASE(exp, "subnormal", exp_d,
+               (InputRange{ UNIFORM, -745, -708 }), 1),
+    UNARY_CASE(log, "random", log_d,
+               (InputRange{ LOG_UNIFORM, 1e-300, 1e300 }), 1),
+    UNARY_CASE(log, "near_one", log_d,
+               (InputRange{ UNIFORM, 1 - 1.0 / 1024, 1 + 1.0 / 1024 }), 1),
+    BINARY_CASE(pow, "random", pow_d, (InputRange{ UNIFORM, 0, 4 }),
+                (InputRange{ UNIFORM, -30, 30 }), 1),
+    BINARY_CASE(pow, "near_one", pow_d,
+                (InputRange{ UNIFORM, 1 - 1.0 / 4096, 1 + 1.0 / 4096 }),
+                (InputRange{ SIGNED_LOG_UNIFORM, 1, 1e6 }), 1),
+  };
+  run_cases("double", cases, sizeof(cases) / sizeof(cases[0]));
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2016 The Fuchsia Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Benchmark companion to TestManyThreadsSeq. Measures the latency of
+ * create+join and create+detach at several stack sizes, set with
+ * pthread_attr_setstacksize as thread_stack_test.cc does, thread creation
+ * from many parent threads at once, and the resident memory each live
+ * thread costs. These are the startup costs of a thread-per-request server.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int kIterations = 2000;
+const int kConcurrentIterations = 500;
+/* Live threads per stack size when measuring resident memory. */
+const int kRssThreads = 64;
+/* 0 means the default stack size. */
+const size_t kStackSizes[] = {
+  0, 64 << 10, 256 << 10, 1 << 20, 8 << 20
+};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Shared by every detached thread. Its semaphore is never destroyed, since
+ * a detached thread may still be inside sem_post after the waiter returns.
+ */
+struct DetachArg {
+  sem_t started;
+  uint64_t start_ns;
+};
+
+struct ParentState {
+  std::vector<uint32_t> latencies;
+};
+
+struct BlockedArg {
+  sem_t *running;
+  sem_t *release;
+};
+
+class ThreadLifecycleBenchTests : public ::testing::Test {
+ protected:
+
+  ThreadLifecycleBenchTests() {
+    // You can do set-up work for each test here.
+  }
+
+  ~ThreadLifecycleBenchTests() override {
+  }
+
+
+  void SetUp() override {
+  }
+
+  void TearDown() override {
+  }
+};
+
+void *empty_thread(void * /* unused_arg */) {
+  return NULL;
+}
+
+DetachArg *new_detach_arg() {
+  DetachArg *arg = new DetachArg;
+  if (sem_init(&arg->started, 0, 0) != 0) {
+    delete arg;
+    return NULL;
+  }
+  return arg;
+}
+
+void *detached_thread(void *arg) {
+  DetachArg *detach_arg = (DetachArg*)arg;
+  detach_arg->start_ns = now_ns();
+  sem_post(&detach_arg->started);
+  return NULL;
+}
+
+/* Creates and joins threads, timing each create+join pair. */
+void *parent_thread(void *arg) {
+  ParentState *state = (ParentState*)arg;
+  for (int i = 0; i < kConcurrentIterations; i++) {
+    pthread_t tid;
+    uint64_t start = now_ns();
+    if (pthread_create(&tid, NULL, empty_thread, NULL) != 0)
+      break;
+    pthread_join(tid, NULL);
+    state->latencies.push_back(now_ns() - start);
+  }
+  return NULL;
+}
+
+void *blocked_thread(void *arg) {
+  BlockedArg *blocked_arg = (BlockedArg*)arg;
+  sem_post(blocked_arg->running);
+  sem_wait(blocked_arg->release);
+  return NULL;
+}
+
+void init_stack_attr(pthread_attr_t *attr, size_t stack_size) {
+  ASSERT_EQ(pthread_attr_init(attr), 0);
+  if (stack_size != 0) {
+    ASSERT_EQ(pthread_attr_setstacksize(attr, stack_size), 0);
+  }
+}
+
+/* Stack size column of the results; 0 prints as "default". */
+const char *stack_label(size_t stack_size, char *buf, size_t buf_size) {
+  if (stack_size == 0)
+    return "default";
+  snprintf(buf, buf_size, "%zuKiB", stack_size >> 10);
+  return buf;
+}
+
+/* Sorts latencies and prints p50, p90, p99 and the maximum. */
+void print_latencies(const char *name, size_t stack_size,
+                     std::vector<uint32_t> *latencies) {
+  ASSERT_FALSE(latencies->empty());
+  size_t n = latencies->size();
+  std::sort(latencies->begin(), latencies->end());
+  char buf[32];
+  printf("%s stack=%s: p50=%u ns, p90=%u ns, p99=%u ns, max=%u ns\n",
+         name, stack_label(stack_size, buf, sizeof(buf)),
+         (*latencies)[n / 2], (*latencies)[n * 90 / 100],
+         (*latencies)[n * 99 / 100], (*latencies)[n - 1]);
+}
+
+/*
+ * Current resident set size in KiB, or -1 where /proc/self/statm does not
+ * exist. getrusage only reports the peak, which earlier tests in the same
+ * binary may already have pushed above anything measured here.
+ */
+long current_rss_kib() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return -1;
+  long size, resident;
+  int count = fscanf(file, "%ld %ld", &size, &resident);
+  fclose(file);
+  if (count != 2)
+    return -1;
+  return resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+} //namespace
+
+TEST_F(ThreadLifecycleBenchTests, TestCreateJoinLatency) {
+  for (size_t s = 0; s < sizeof(kStackSizes) / sizeof(kStackSizes[0]); s++) {
+    pthread_attr_t attr;
+    init_stack_attr(&attr, kStackSizes[s]);
+    std::vector<uint32_t> latencies;
+    for (int i = 0; i < kIterations; i++) {
+      pthread_t tid;
+      uint64_t start = now_ns();
+      ASSERT_EQ(pthread_create(&tid, &attr, empty_thread, NULL), 0);
+      ASSERT_EQ(pthread_join(tid, NULL), 0);
+      latencies.push_back(now_ns() - start);
+    }
+    ASSERT_EQ(pthread_attr_destroy(&attr), 0);
+    print_latencies("CreateJoin", kStackSizes[s], &latencies);
+  }
+}
+
+/*
+ * Times the pthread_create call itself and the delay until the new thread
+ * runs. Each thread is waited for before the next is created, but may
+ * still be exiting.
+ */
+TEST_F(ThreadLifecycleBenchTests, TestCreateDetachLatency) {
+  static DetachArg *const detach_arg = new_detach_arg();
+  ASSERT_NE(detach_arg, nullptr);
+  DetachArg &arg = *detach_arg;
+  for (size_t s = 0; s < sizeof(kStackSizes) / sizeof(kStackSizes[0]); s++) {
+    pthread_attr_t attr;
+    init_stack_attr(&attr, kStackSizes[s]);
+    ASSERT_EQ(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED), 0);
+    std::vector<uint32_t> create_latencies;
+    std::vector<uint32_t> start_latencies;
+    for (int i = 0; i < kIterations; i++) {
+      pthread_t tid;
+      uint64_t start = now_ns();
+      ASSERT_EQ(pthread_create(&tid, &attr, detached_thread, detach_arg), 0);
+      create_latencies.push_back(now_ns() - start);
+      ASSERT_EQ(sem_wait(&arg.started), 0);
+      start_latencies.push_back(arg.start_ns - start);
+    }
+    ASSERT_EQ(pthread_attr_destroy(&attr), 0);
+    print_latencies("CreateDetach", kStackSizes[s], &create_latencies);
+    print_latencies("DetachedStart", kStackSizes[s], &start_latencies);
+  }
+}
+
+/*
+ * 1, 2, 4 ... parents up to twice the number of processors, each running
+ * create+join cycles with the default stack size.
+ */
+TEST_F(ThreadLifecycleBenchTests, TestConcurrentCreate) {
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_parents = nprocs > 1 ? 2 * nprocs : 2;
+  for (int nparents = 1; nparents <= max_parents; nparents *= 2) {
+    std::vector<ParentState> states(nparents);
+    std::vector<pthread_t> tids(nparents);
+    uint64_t start = now_ns();
+    for (int i = 0; i < nparents; i++)
+      ASSERT_EQ(pthread_create(&tids[i], NULL, parent_thread, &states[i]), 0);
+    for (int i = 0; i < nparents; i++)
+      ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+    uint64_t elapsed = now_ns() - start;
+
+    std::vector<uint32_t> latencies;
+    for (int i = 0; i < nparents; i++) {
+      latencies.insert(latencies.end(), states[i].latencies.begin(),
+                       states[i].latencies.end());
+    }
+    ASSERT_EQ(latencies.size(), (size_t)nparents * kConcurrentIterations);
+    size_t n = latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    printf("ConcurrentCreateJoin parents=%d: %.0f threads/sec, p50=%u ns, "
+           "p99=%u ns\n",
+           nparents, n / (elapsed / 1e9), latencies[n / 2],
+           latencies[n * 99 / 100]);
+  }
+}
+
+/*
+ * Resident memory of kRssThreads live threads at each stack size. The
+ * threads do not touch their stacks beyond what starting up needs, so this
+ * is the fixed cost per thread rather than the stack size.
+ */
+TEST_F(ThreadLifecycleBenchTests, TestRssPerThread) {
+  if (current_rss_kib() < 0) {
+    printf("RssPerThread: resident set size not available\n");
+    return;
+  }
+  sem_t running, release;
+  ASSERT_EQ(sem_init(&running, 0, 0), 0);
+  ASSERT_EQ(sem_init(&release, 0, 0), 0);
+  BlockedArg arg = { &running, &release };
+  for (size_t s = 0; s < sizeof(kStackSizes) / sizeof(kStackSizes[0]); s++) {
+    pthread_attr_t attr;
+    init_stack_attr(&attr, kStackSizes[s]);
+    std::vector<pthread_t> tids(kRssThreads);
+    long before = current_rss_kib();
+    for (int i = 0; i < kRssThreads; i++)
+      ASSERT_EQ(pthread_create(&tids[i], &attr, blocked_thread, &arg), 0);
+    for (int i = 0; i < kRssThreads; i++)
+      ASSERT_EQ(sem_wait(&running), 0);
+    long after = current_rss_kib();
+    for (int i = 0; i < kRssThreads; i++)
+      ASSERT_EQ(sem_post(&release), 0);
+    for (int i = 0; i < kRssThreads; i++)
+      ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+    ASSERT_EQ(pthread_attr_destroy(&attr), 0);
+    char buf[32];
+    printf("RssPerThread stack=%s: %.1f KiB per thread\n",
+           stack_label(kStackSizes[s], buf, sizeof(buf)),
+           (double)(after - before) / kRssThreads);
+  }
+  ASSERT_EQ(sem_destroy(&release), 0);
+  ASSERT_EQ(sem_destroy(&running), 0);
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2016 The Fuchsia Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Per-access cost of thread-local storage, next to the correctness checks
+ * in tls.cc. Each variable is reached through a noinline accessor, so that
+ * the address computation is redone on every access, and the cost of a
+ * plain global through the same kind of accessor is reported alongside.
+ *
+ * In the main executable the compiler or linker relaxes the local-dynamic
+ * and global-dynamic models to local-exec, so only the dlopen'd module in
+ * tls_bench_module.cc measures real __tls_get_addr calls.
+ */
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const int kAccesses = 10000000;
+/* Best of kRounds, to filter out preemption. */
+const int kRounds = 5;
+
+const char kBenchModule[] = "libtls_bench_module.so";
+
+typedef int *(*tls_accessor)(void);
+
+struct AccessorCase {
+  const char *name;
+  tls_accessor accessor;
+};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+class TlsAccessBenchTests : public ::testing::Test {
+ protected:
+
+  TlsAccessBenchTests() {
+    // You can do set-up work for each test here.
+  }
+
+  ~TlsAccessBenchTests() override {
+  }
+
+
+  void SetUp() override {
+  }
+
+  void TearDown() override {
+  }
+};
+
+int plain_global;
+__thread int tls_local_exec __attribute__((tls_model("local-exec")));
+__thread int tls_initial_exec __attribute__((tls_model("initial-exec")));
+__thread int tls_local_dynamic __attribute__((tls_model("local-dynamic")));
+__thread int tls_global_dynamic __attribute__((tls_model("global-dynamic")));
+
+pthread_key_t tls_key;
+
+__attribute__((noinline)) int *get_plain_global(void) {
+  return &plain_global;
+}
+
+__attribute__((noinline)) int *get_local_exec(void) {
+  return &tls_local_exec;
+}
+
+__attribute__((noinline)) int *get_initial_exec(void) {
+  return &tls_initial_exec;
+}
+
+__attribute__((noinline)) int *get_local_dynamic(void) {
+  return &tls_local_dynamic;
+}
+
+__attribute__((noinline)) int *get_global_dynamic(void) {
+  return &tls_global_dynamic;
+}
+
+__attribute__((noinline)) int *get_pthread_specific(void) {
+  return (int*)pthread_getspecific(tls_key);
+}
+
+/* Best time per access over kRounds runs of kAccesses increments. */
+double time_accessor(tls_accessor accessor) {
+  /* Calling through a volatile pointer keeps the call in the loop. */
+  tls_accessor volatile call = accessor;
+  double best = 0;
+  for (int round = 0; round < kRounds; round++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < kAccesses; i++)
+      (*call())++;
+    double per_access = (double)(now_ns() - start) / kAccesses;
+    if (round == 0 || per_access < best)
+      best = per_access;
+  }
+  return best;
+}
+
+struct RunArg {
+  const AccessorCase *cases;
+  size_t count;
+  const char *thread_name;
+};
+
+/*
+ * Times every case on the calling thread. pthread_getspecific needs a value
+ * for this thread, so one is set here.
+ */
+void *run_cases(void *arg) {
+  RunArg *run_arg = (RunArg*)arg;
+  int specific = 0;
+  pthread_setspecific(tls_key, &specific);
+  double baseline = time_accessor(get_plain_global);
+  printf("%s plain global: %.2f ns/access\n", run_arg->thread_name, baseline);
+  for (size_t i = 0; i < run_arg->count; i++) {
+    const AccessorCase *c = &run_arg->cases[i];
+    double per_access = time_accessor(c->accessor);
+    printf("%s %s: %.2f ns/access (%+.2f ns over plain global)\n",
+           run_arg->thread_name, c->name, per_access, per_access - baseline);
+  }
+  pthread_setspecific(tls_key, NULL);
+  return NULL;
+}
+
+/*
+ * Runs the cases on the main thread and on a new thread, whose TLS may be
+ * set up differently from the main thread's.
+ */
+void run_on_both_threads(const AccessorCase *cases, size_t count) {
+  RunArg main_arg = { cases, count, "main thread" };
+  run_cases(&main_arg);
+  RunArg thread_arg = { cases, count, "new thread" };
+  pthread_t tid;
+  ASSERT_EQ(pthread_create(&tid, NULL, run_cases, &thread_arg), 0);
+  ASSERT_EQ(pthread_join(tid, NULL), 0);
+}
+
+/*
+ * Loads tls_bench_module from the library search path, where the package
+ * installs it, or else from the directory holding the test binary, where the
+ * build puts it. Returns NULL if neither has it.
+ */
+void *open_bench_module(void) {
+  void *handle = dlopen(kBenchModule, RTLD_NOW);
+  if (handle != NULL)
+    return handle;
+  char exe[4096];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len <= 0)
+    return NULL;
+  exe[len] = '\0';
+  const char *slash = strrchr(exe, '/');
+  if (slash == NULL)
+    return NULL;
+  std::string path(exe, slash + 1 - exe);
+  path += kBenchModule;
+  return dlopen(path.c_str(), RTLD_NOW);
+}
+
+} //namespace
+
+TEST_F(TlsAccessBenchTests, TestTlsAccessCost) {
+  const AccessorCase cases[] = {
+    { "__thread local-exec", get_local_exec },
+    { "__thread initial-exec", get_initial_exec },
+    { "__thread local-dynamic", get_local_dynamic },
+    { "__thread global-dynamic", get_global_dynamic },
+    { "pthread_getspecific", get_pthread_specific },
+  };
+  ASSERT_EQ(pthread_key_create(&tls_key, NULL), 0);
+  run_on_both_threads(cases, sizeof(cases) / sizeof(cases[0]));
+  ASSERT_EQ(pthread_key_delete(tls_key), 0);
+}
+
+TEST_F(TlsAccessBenchTests, TestDlopenModuleTls) {
+  void *handle = open_bench_module();
+  if (handle == NULL) {
+    printf("Skipping: cannot load %s: %s\n", kBenchModule, dlerror());
+    return;
+  }
+  tls_accessor local_dynamic =
+      (tls_accessor)dlsym(handle, "tls_bench_module_local_dynamic");
+  ASSERT_NE(nullptr, local_dynamic) << dlerror();
+  tls_accessor global_dynamic =
+      (tls_accessor)dlsym(handle, "tls_bench_module_global_dynamic");
+  ASSERT_NE(nullptr, global_dynamic) << dlerror();
+
+  const AccessorCase cases[] = {
+    { "dlopen'd module local-dynamic", local_dynamic },
+    { "dlopen'd module global-dynamic", global_dynamic },
+  };
+  ASSERT_EQ(pthread_key_create(&tls_key, NULL), 0);
+  run_on_both_threads(cases, sizeof(cases) / sizeof(cases[0]));
+  ASSERT_EQ(pthread_key_delete(tls_key), 0);
+  ASSERT_EQ(dlclose(handle), 0);
+}
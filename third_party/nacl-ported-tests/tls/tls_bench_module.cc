@@ -0,0 +1,26 @@
+/*
+ * Copyright 2016 The Fuchsia Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Loaded with dlopen by TestDlopenModuleTls. TLS in a dlopen'd module
+ * cannot use the static TLS block, so these accessors go through
+ * __tls_get_addr with the model they ask for.
+ */
+
+static __thread int module_local_dynamic
+    __attribute__((tls_model("local-dynamic")));
+__thread int module_global_dynamic
+    __attribute__((tls_model("global-dynamic")));
+
+extern "C" __attribute__((visibility("default")))
+int *tls_bench_module_local_dynamic(void) {
+  return &module_local_dynamic;
+}
+
+extern "C" __attribute__((visibility("default")))
+int *tls_bench_module_global_dynamic(void) {
+  return &module_global_dynamic;
+}
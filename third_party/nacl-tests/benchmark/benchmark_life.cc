@@ -6,19 +6,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
 #include "native_client/tests/benchmark/framework.h"
 #include "native_client/tests/benchmark/thread_pool.h"
 
 
 using sdk_util::ThreadPool;  // For sdk_util::ThreadPool
+using sdk_util::ThreadPoolOptions;
+using sdk_util::ThreadPoolStats;
 
 namespace {
 
 const int kCellAlignment = 0x10;
+// Slack after each buffer, so that vector loads near the end of the last
+// row stay inside the allocation.
+const int kCellPadding = 0x40;
 const int kWidth = 2048;
 const int kHeight = 2048;
+const unsigned kSeed = 1;
+
+// Kernels used to compute a frame.
+enum LifeKernel {
+  // One byte per cell, one cell at a time.
+  kKernelScalar,
+  // One byte per cell, 16 cells per iteration (SSE/NEON width).
+  kKernelSimd16,
+  // One byte per cell, 32 cells per iteration.  Compiled for AVX2 where
+  // the CPU has it, and otherwise split into narrower vectors.
+  kKernelSimd32,
+  // One bit per cell, 64 cells per uint64_t word, using bitwise adders.
+  kKernelBitPacked
+};
 
 #if defined(HAVE_SIMD)
 // 128 bit vector types
@@ -27,55 +50,165 @@ typedef uint8_t u8x16_t __attribute__((vector_size(16)))
 // TODO(dschuff): remove aligned(1) attribute above once nacl-clang has
 // same vector alignment rules as pnacl.
 
+// 256 bit vector types.  On targets without 256 bit registers the compiler
+// splits these into pairs of 128 bit operations.  Values of this type are
+// never passed to or returned from functions, since that ABI depends on
+// whether AVX is enabled.
+typedef uint8_t u8x32_t __attribute__((vector_size(32)))
+                        __attribute__((aligned(1)));
+
 // Helper function to broadcast x across 16 element vector.
 INLINE u8x16_t broadcast(uint8_t x) {
   u8x16_t r = {x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x};
   return r;
 }
+
+// Helper function to broadcast x across 32 element vector.
+INLINE void broadcast32(uint8_t x, u8x32_t* r) {
+  u8x32_t v = {x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x,
+               x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x};
+  *r = v;
+}
+
+// Computes the first count / 32 * 32 cells of a row for kKernelSimd32, from
+// the three source rows starting one cell to the left of the first cell.
+// Returns the number of cells done.  Rather than shuffling, the jittered
+// sources are read with unaligned loads, which is cheap on CPUs with 256 bit
+// vectors.
+INLINE int32_t Simd32Row(const uint8_t* src0, const uint8_t* src1,
+                         const uint8_t* src2, uint8_t* dst, int32_t count) {
+  u8x32_t kOne;
+  u8x32_t kFour;
+  u8x32_t kEight;
+  broadcast32(1, &kOne);
+  broadcast32(4, &kFour);
+  broadcast32(8, &kEight);
+  int32_t x = 0;
+  for (; x + 32 <= count; x += 32) {
+    u8x32_t sum = *reinterpret_cast<const u8x32_t*>(&src0[x]) +
+                  *reinterpret_cast<const u8x32_t*>(&src0[x + 1]) +
+                  *reinterpret_cast<const u8x32_t*>(&src0[x + 2]) +
+                  *reinterpret_cast<const u8x32_t*>(&src1[x]) +
+                  *reinterpret_cast<const u8x32_t*>(&src1[x + 2]) +
+                  *reinterpret_cast<const u8x32_t*>(&src2[x]) +
+                  *reinterpret_cast<const u8x32_t*>(&src2[x + 1]) +
+                  *reinterpret_cast<const u8x32_t*>(&src2[x + 2]);
+    // Add the center cell.
+    sum = sum + sum + *reinterpret_cast<const u8x32_t*>(&src1[x + 1]);
+    // If sum > 4 and < 8, center cell will be alive in the next frame.
+    u8x32_t alive1 = sum > kFour;
+    u8x32_t alive2 = sum < kEight;
+    u8x32_t alive = alive1 & alive2;
+    *reinterpret_cast<u8x32_t*>(&dst[x]) = alive & kOne;
+  }
+  return x;
+}
+
+// The same kernel built for the default target, and for AVX2 on x86 hosts
+// where the compiler can check for it at run time.
+int32_t Simd32RowGeneric(const uint8_t* src0, const uint8_t* src1,
+                         const uint8_t* src2, uint8_t* dst, int32_t count) {
+  return Simd32Row(src0, src1, src2, dst, count);
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+    !defined(__native_client__)
+#define HAVE_AVX2_KERNEL 1
+__attribute__((target("avx2")))
+int32_t Simd32RowAvx2(const uint8_t* src0, const uint8_t* src1,
+                      const uint8_t* src2, uint8_t* dst, int32_t count) {
+  return Simd32Row(src0, src1, src2, dst, count);
+}
+#endif
+
+bool UseAvx2Kernel() {
+#if defined(HAVE_AVX2_KERNEL)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  return has_avx2;
+#else
+  return false;
+#endif
+}
+
+const LifeKernel kDefaultKernel = kKernelSimd16;
+#else
+const LifeKernel kDefaultKernel = kKernelScalar;
 #endif  // HAVE_SIMD
 
 class Life {
  public:
-  Life();
+  Life(int width, int height, LifeKernel kernel);
   virtual ~Life();
   void Reset();
-  void SimulateFrame();
+  void SimulateFrame(ThreadPool* workers);
+  bool IsAlive(int x, int y) const;
  private:
   void wSimulate(int y);
+  void wSimulateBitPacked(int y);
   static void wSimulateEntry(int y, void* data);
 
+  const int width_;
+  const int height_;
+  const LifeKernel kernel_;
   uint8_t* cell_in_;
   uint8_t* cell_out_;
   int32_t cell_stride_;
   size_t size_;
-  ThreadPool* workers_;
+  // kKernelBitPacked state: bit x % 64 of word x / 64 holds cell x.
+  uint64_t* bits_in_;
+  uint64_t* bits_out_;
+  int32_t words_per_row_;
 };
 
-Life::Life() :
+Life::Life(int width, int height, LifeKernel kernel) :
+    width_(width),
+    height_(height),
+    kernel_(kernel),
     cell_in_(NULL),
     cell_out_(NULL),
-    cell_stride_(0) {
-  // Query system for number of processors via sysconf()
-  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-  workers_ = num_threads < 2 ? NULL : new ThreadPool(num_threads);
-  cell_stride_ = (kWidth + kCellAlignment - 1) &
-      ~(kCellAlignment - 1);
-  size_ = cell_stride_ * kHeight;
-
-  // Create a new context
+    cell_stride_(0),
+    bits_in_(NULL),
+    bits_out_(NULL),
+    words_per_row_(0) {
   void* in_buffer = NULL;
   void* out_buffer = NULL;
+  if (kernel_ == kKernelBitPacked) {
+    words_per_row_ = (width_ + 63) / 64;
+    size_ = words_per_row_ * sizeof(uint64_t) * height_;
+  } else {
+    cell_stride_ = (width_ + kCellAlignment - 1) &
+        ~(kCellAlignment - 1);
+    size_ = cell_stride_ * height_;
+  }
+
+  // Create a new context
   // alloc buffers aligned on 16 bytes
-  posix_memalign(&in_buffer, kCellAlignment, size_);
-  posix_memalign(&out_buffer, kCellAlignment, size_);
-  cell_in_ = (uint8_t*) in_buffer;
-  cell_out_ = (uint8_t*) out_buffer;
+  posix_memalign(&in_buffer, kCellAlignment, size_ + kCellPadding);
+  posix_memalign(&out_buffer, kCellAlignment, size_ + kCellPadding);
+  memset(in_buffer, 0, size_ + kCellPadding);
+  memset(out_buffer, 0, size_ + kCellPadding);
+  if (kernel_ == kKernelBitPacked) {
+    bits_in_ = (uint64_t*) in_buffer;
+    bits_out_ = (uint64_t*) out_buffer;
+  } else {
+    cell_in_ = (uint8_t*) in_buffer;
+    cell_out_ = (uint8_t*) out_buffer;
+  }
 
   Reset();
 }
 
 Life::~Life() {
-  delete workers_;
+  free(cell_in_);
+  free(cell_out_);
+  free(bits_in_);
+  free(bits_out_);
+}
+
+bool Life::IsAlive(int x, int y) const {
+  if (kernel_ == kKernelBitPacked)
+    return (bits_in_[y * words_per_row_ + x / 64] >> (x % 64)) & 1;
+  return cell_in_[y * cell_stride_ + x] != 0;
 }
 
 void Life::wSimulate(int y) {
@@ -87,9 +220,14 @@ void Life::wSimulate(int y) {
   };
 
   // Don't run simulation on top and bottom borders
-  if (y < 1 || y >= kHeight - 1)
+  if (y < 1 || y >= height_ - 1)
     return;
 
+  if (kernel_ == kKernelBitPacked) {
+    wSimulateBitPacked(y);
+    return;
+  }
+
   // Do neighbor summation; apply rules, output pixel color. Note that a 1 cell
   // wide perimeter is excluded from the simulation update; only cells from
   // x = 1 to x < width - 1 and y = 1 to y < height - 1 are updated.
@@ -100,74 +238,90 @@ void Life::wSimulate(int y) {
   int32_t x = 1;
 
 #if defined(HAVE_SIMD)
-  const u8x16_t kOne = broadcast(1);
-  const u8x16_t kFour = broadcast(4);
-  const u8x16_t kEight = broadcast(8);
-
-  // Prime the src
-  u8x16_t src00 = *reinterpret_cast<u8x16_t*>(&src0[0]);
-  u8x16_t src01 = *reinterpret_cast<u8x16_t*>(&src0[16]);
-  u8x16_t src10 = *reinterpret_cast<u8x16_t*>(&src1[0]);
-  u8x16_t src11 = *reinterpret_cast<u8x16_t*>(&src1[16]);
-  u8x16_t src20 = *reinterpret_cast<u8x16_t*>(&src2[0]);
-  u8x16_t src21 = *reinterpret_cast<u8x16_t*>(&src2[16]);
-
-  // This inner loop is SIMD - each loop iteration will process 16 cells.
-  for (; (x + 15) < (kWidth - 1); x += 16) {
-    // Construct jittered source temps, using __builtin_shufflevector(..) to
-    // extract a shifted 16 element vector from the 32 element concatenation
-    // of two source vectors.
-    u8x16_t src0j0 = src00;
-    u8x16_t src0j1 = __builtin_shufflevector(src00, src01,
-        1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
-    u8x16_t src0j2 = __builtin_shufflevector(src00, src01,
-        2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
-    u8x16_t src1j0 = src10;
-    u8x16_t src1j1 = __builtin_shufflevector(src10, src11,
-        1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
-    u8x16_t src1j2 = __builtin_shufflevector(src10, src11,
-        2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
-    u8x16_t src2j0 = src20;
-    u8x16_t src2j1 = __builtin_shufflevector(src20, src21,
-        1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
-    u8x16_t src2j2 = __builtin_shufflevector(src20, src21,
-        2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
-
-    // Sum the jittered sources to construct neighbor count.
-    u8x16_t count = src0j0 + src0j1 +  src0j2 +
-                    src1j0 +        +  src1j2 +
-                    src2j0 + src2j1 +  src2j2;
-    // Add the center cell.
-    count = count + count + src1j1;
-    // If count > 4 and < 8, center cell will be alive in the next frame.
-    u8x16_t alive1 = count > kFour;
-    u8x16_t alive2 = count < kEight;
-    // Intersect the two comparisons from above.
-    u8x16_t alive = alive1 & alive2;
-
-    // Convert alive mask to 1 or 0 and store in destination cell array.
-    *reinterpret_cast<u8x16_t*>(dst) = alive & kOne;
-
-    // Increment pointers.
-    dst += 16;
-    src0 += 16;
-    src1 += 16;
-    src2 += 16;
-
-    // Shift source over by 16 cells and read the next 16 cells.
-    src00 = src01;
-    src01 = *reinterpret_cast<u8x16_t*>(&src0[16]);
-    src10 = src11;
-    src11 = *reinterpret_cast<u8x16_t*>(&src1[16]);
-    src20 = src21;
-    src21 = *reinterpret_cast<u8x16_t*>(&src2[16]);
+  if (kernel_ == kKernelSimd16) {
+    const u8x16_t kOne = broadcast(1);
+    const u8x16_t kFour = broadcast(4);
+    const u8x16_t kEight = broadcast(8);
+
+    // Prime the src
+    u8x16_t src00 = *reinterpret_cast<u8x16_t*>(&src0[0]);
+    u8x16_t src01 = *reinterpret_cast<u8x16_t*>(&src0[16]);
+    u8x16_t src10 = *reinterpret_cast<u8x16_t*>(&src1[0]);
+    u8x16_t src11 = *reinterpret_cast<u8x16_t*>(&src1[16]);
+    u8x16_t src20 = *reinterpret_cast<u8x16_t*>(&src2[0]);
+    u8x16_t src21 = *reinterpret_cast<u8x16_t*>(&src2[16]);
+
+    // This inner loop is SIMD - each loop iteration will process 16 cells.
+    for (; (x + 15) < (width_ - 1); x += 16) {
+      // Construct jittered source temps, using __builtin_shufflevector(..) to
+      // extract a shifted 16 element vector from the 32 element concatenation
+      // of two source vectors.
+      u8x16_t src0j0 = src00;
+      u8x16_t src0j1 = __builtin_shufflevector(src00, src01,
+          1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+      u8x16_t src0j2 = __builtin_shufflevector(src00, src01,
+          2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+      u8x16_t src1j0 = src10;
+      u8x16_t src1j1 = __builtin_shufflevector(src10, src11,
+          1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+      u8x16_t src1j2 = __builtin_shufflevector(src10, src11,
+          2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+      u8x16_t src2j0 = src20;
+      u8x16_t src2j1 = __builtin_shufflevector(src20, src21,
+          1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16);
+      u8x16_t src2j2 = __builtin_shufflevector(src20, src21,
+          2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17);
+
+      // Sum the jittered sources to construct neighbor count.
+      u8x16_t count = src0j0 + src0j1 +  src0j2 +
+                      src1j0 +        +  src1j2 +
+                      src2j0 + src2j1 +  src2j2;
+      // Add the center cell.
+      count = count + count + src1j1;
+      // If count > 4 and < 8, center cell will be alive in the next frame.
+      u8x16_t alive1 = count > kFour;
+      u8x16_t alive2 = count < kEight;
+      // Intersect the two comparisons from above.
+      u8x16_t alive = alive1 & alive2;
+
+      // Convert alive mask to 1 or 0 and store in destination cell array.
+      *reinterpret_cast<u8x16_t*>(dst) = alive & kOne;
+
+      // Increment pointers.
+      dst += 16;
+      src0 += 16;
+      src1 += 16;
+      src2 += 16;
+
+      // Shift source over by 16 cells and read the next 16 cells.
+      src00 = src01;
+      src01 = *reinterpret_cast<u8x16_t*>(&src0[16]);
+      src10 = src11;
+      src11 = *reinterpret_cast<u8x16_t*>(&src1[16]);
+      src20 = src21;
+      src21 = *reinterpret_cast<u8x16_t*>(&src2[16]);
+    }
+  } else if (kernel_ == kKernelSimd32) {
+    // Each loop iteration will process 32 cells.
+    int32_t done;
+#if defined(HAVE_AVX2_KERNEL)
+    if (UseAvx2Kernel())
+      done = Simd32RowAvx2(src0, src1, src2, dst, width_ - 2);
+    else
+#endif
+      done = Simd32RowGeneric(src0, src1, src2, dst, width_ - 2);
+    x += done;
+    dst += done;
+    src0 += done;
+    src1 += done;
+    src2 += done;
   }
 #endif  // HAVE_SIMD
 
-  // The SIMD loop above does 16 cells at a time.  The loop below is the
+  // The SIMD loops above do 16 or 32 cells at a time.  The loop below is the
   // regular version which processes one cell at a time.  It is used to
   // finish the remainder of the scanline not handled by the SIMD loop.
-  for (; x < (kWidth - 1); ++x) {
+  for (; x < (width_ - 1); ++x) {
     // Sum the jittered sources to construct neighbor count.
     int count = src0[0] + src0[1] + src0[2] +
                 src1[0] +         + src1[2] +
@@ -182,40 +336,153 @@ void Life::wSimulate(int y) {
   }
 }
 
+// Bit-packed version of wSimulate().  The eight neighbor masks of a word are
+// summed with a bitwise ripple adder, so 64 cells are updated at once.  The
+// first and last column are left untouched, as in the byte versions.
+void Life::wSimulateBitPacked(int y) {
+  const uint64_t* rows[3] = {
+      bits_in_ + (y - 1) * words_per_row_,
+      bits_in_ + y * words_per_row_,
+      bits_in_ + (y + 1) * words_per_row_
+  };
+  uint64_t* dst = bits_out_ + y * words_per_row_;
+  for (int32_t i = 0; i < words_per_row_; i++) {
+    uint64_t neighbors[8];
+    int n = 0;
+    for (int r = 0; r < 3; r++) {
+      uint64_t word = rows[r][i];
+      uint64_t prev = i > 0 ? rows[r][i - 1] : 0;
+      uint64_t next = i + 1 < words_per_row_ ? rows[r][i + 1] : 0;
+      // Cells at x - 1 and x + 1 for every bit of the word.
+      neighbors[n++] = (word << 1) | (prev >> 63);
+      neighbors[n++] = (word >> 1) | (next << 63);
+      if (r != 1)
+        neighbors[n++] = word;
+    }
+    // Count neighbors in two bits, with a sticky bit for 4 or more.
+    uint64_t sum0 = 0;
+    uint64_t sum1 = 0;
+    uint64_t sum_high = 0;
+    for (int j = 0; j < 8; j++) {
+      uint64_t carry0 = sum0 & neighbors[j];
+      sum0 ^= neighbors[j];
+      uint64_t carry1 = sum1 & carry0;
+      sum1 ^= carry0;
+      sum_high |= carry1;
+    }
+    // Alive with 3 neighbors, or with 2 neighbors if alive already.
+    uint64_t alive = ~sum_high & sum1 & (sum0 | rows[1][i]);
+
+    // Only update cells from x = 1 to x < width - 1.
+    uint64_t update = ~(uint64_t) 0;
+    if (i == 0)
+      update &= ~(uint64_t) 1;
+    int last = width_ - 2 - i * 64;
+    if (last < 63)
+      update &= last < 0 ? 0 : (((uint64_t) 2 << last) - 1);
+    dst[i] = (alive & update) | (dst[i] & ~update);
+  }
+}
+
 // Static entry point for worker thread.
 void Life::wSimulateEntry(int slice, void* thiz) {
   static_cast<Life*>(thiz)->wSimulate(slice);
 }
 
-void Life::SimulateFrame() {
-  if (workers_) {
+void Life::SimulateFrame(ThreadPool* workers) {
+  if (workers) {
     // If multi-threading enabled, dispatch tasks to pool of worker threads.
-    workers_->Dispatch(kHeight, wSimulateEntry, this);
+    workers->Dispatch(height_, wSimulateEntry, this);
   } else {
     // Else manually simulate each line on this thread.
-    for (int y = 0; y < kHeight; y++) {
+    for (int y = 0; y < height_; y++) {
       wSimulateEntry(y, this);
     }
   }
   std::swap(cell_in_, cell_out_);
+  std::swap(bits_in_, bits_out_);
 }
 
+// Every kernel starts from the same grid for a given size.
 void Life::Reset() {
+  unsigned seed = kSeed;
+  if (kernel_ == kKernelBitPacked) {
+    memset(bits_out_, 0, size_);
+    memset(bits_in_, 0, size_);
+    for (int y = 0; y < height_; y++) {
+      uint64_t* row = bits_in_ + y * words_per_row_;
+      for (int x = 0; x < width_; x++)
+        row[x / 64] |= (uint64_t) (rand_r(&seed) & 1) << (x % 64);
+    }
+    return;
+  }
   memset(cell_out_, 0, size_);
-  for (size_t index = 0; index < size_; index++) {
-    cell_in_[index] = rand() & 1;
+  memset(cell_in_, 0, size_);
+  for (int y = 0; y < height_; y++) {
+    for (int x = 0; x < width_; x++)
+      cell_in_[y * cell_stride_ + x] = rand_r(&seed) & 1;
+  }
+}
+
+// Check that a kernel evolves a grid exactly like the scalar kernel does.
+// The width is not a multiple of 64 so that partial words and vectors are
+// covered too.
+bool VerifyKernel(LifeKernel kernel) {
+  const int kVerifyWidth = 203;
+  const int kVerifyHeight = 37;
+  const int kVerifyFrames = 4;
+  Life reference(kVerifyWidth, kVerifyHeight, kKernelScalar);
+  Life life(kVerifyWidth, kVerifyHeight, kernel);
+  for (int i = 0; i < kVerifyFrames; i++) {
+    reference.SimulateFrame(NULL);
+    life.SimulateFrame(NULL);
+  }
+  for (int y = 0; y < kVerifyHeight; y++) {
+    for (int x = 0; x < kVerifyWidth; x++) {
+      if (reference.IsAlive(x, y) != life.IsAlive(x, y)) {
+        fprintf(stderr, "Life kernel %d differs from scalar at (%d, %d)\n",
+                kernel, x, y);
+        return false;
+      }
+    }
   }
+  return true;
 }
 
+// Query system for number of processors via sysconf()
+int NumProcessors() {
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  return num_threads < 1 ? 1 : num_threads;
+}
+
+// 1, 2, 4 ... threads up to max_threads, which is included even when it is
+// not a power of two.
+std::vector<int> ThreadCounts(int max_threads) {
+  std::vector<int> counts;
+  for (int n = 1; n < max_threads; n *= 2)
+    counts.push_back(n);
+  counts.push_back(max_threads);
+  return counts;
+}
+
+// Pools with fewer than 2 threads are replaced by running on the
+// dispatch thread.
+ThreadPool* CreateWorkers(int num_threads, const ThreadPoolOptions& options) {
+  return num_threads < 2 ? NULL : new ThreadPool(num_threads, options);
+}
 
 // Wrap life in benchmark harness
 class BenchmarkLife : public Benchmark {
  public:
+  BenchmarkLife()
+      : life_(kWidth, kHeight, kDefaultKernel),
+        workers_(CreateWorkers(NumProcessors(), ThreadPoolOptions())) {}
+  virtual ~BenchmarkLife() { delete workers_; }
   virtual int Run() {
     const int kFramesToBenchmark = 100;
     life_.Reset();
     for (int i = 0; i < kFramesToBenchmark; ++i)
-      life_.SimulateFrame();
+      life_.SimulateFrame(workers_);
     // TODO(nfullagar): make simulation deterministic & compute a checksum on
     // the last frame.  Return success or failure based on the checksum.
     return 0;
@@ -230,9 +497,232 @@ class BenchmarkLife : public Benchmark {
   }
  private:
   Life life_;
+  ThreadPool* workers_;
+};
+
+ThreadPoolOptions SchedulerOptions(sdk_util::SchedulerMode mode,
+                                   sdk_util::WaitMode wait) {
+  ThreadPoolOptions options;
+  options.mode = mode;
+  options.wait = wait;
+  options.collect_stats = true;
+  return options;
+}
+
+void AddStats(ThreadPoolStats* total, const ThreadPoolStats& stats) {
+  total->dispatches += stats.dispatches;
+  total->dispatch_ns += stats.dispatch_ns;
+  total->max_dispatch_ns = std::max(total->max_dispatch_ns,
+                                    stats.max_dispatch_ns);
+  total->wakeup_ns += stats.wakeup_ns;
+  total->idle_ns += stats.idle_ns;
+  total->chunks += stats.chunks;
+  total->steals += stats.steals;
+  total->spin_wakeups += stats.spin_wakeups;
+  total->blocking_waits += stats.blocking_waits;
+}
+
+double GetSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The scheduler benchmarks go up to at least this many threads, so that
+// the cost of spinning shows when workers outnumber the processors.
+const int kMaxSchedulerThreads = 64;
+
+// Life with an instrumented thread pool, to compare scheduler and wait
+// strategies at 1, 2, 4 ... threads.  Unlike the other benchmarks, this
+// uses a pool even for 1 thread, so that every count pays for dispatching.
+// Report() prints the frame rate and per-dispatch costs measured by the
+// pool for each thread count.
+template <sdk_util::SchedulerMode mode, sdk_util::WaitMode wait>
+class BenchmarkLifeScheduler : public Benchmark {
+ public:
+  BenchmarkLifeScheduler()
+      : life_(kWidth, kHeight, kDefaultKernel),
+        thread_counts_(ThreadCounts(std::max(NumProcessors(),
+                                             kMaxSchedulerThreads))),
+        best_cells_per_sec_(thread_counts_.size(), 0),
+        stats_(thread_counts_.size()) {
+    for (size_t i = 0; i < stats_.size(); i++)
+      memset(&stats_[i], 0, sizeof(stats_[i]));
+  }
+  virtual int Run() {
+    const int kFramesPerThreadCount = 20;
+    double cells_per_frame = (double) (kWidth - 2) * (kHeight - 2);
+    for (size_t i = 0; i < thread_counts_.size(); i++) {
+      ThreadPool workers(thread_counts_[i], SchedulerOptions(mode, wait));
+      life_.Reset();
+      double start_time = GetSeconds();
+      for (int f = 0; f < kFramesPerThreadCount; ++f)
+        life_.SimulateFrame(&workers);
+      double cells_per_sec = kFramesPerThreadCount * cells_per_frame /
+          (GetSeconds() - start_time);
+      best_cells_per_sec_[i] = std::max(best_cells_per_sec_[i],
+                                        cells_per_sec);
+      ThreadPoolStats stats;
+      workers.GetStats(&stats);
+      AddStats(&stats_[i], stats);
+    }
+    return 0;
+  }
+  virtual const std::string Name() {
+    return std::string("Life") +
+        (mode == sdk_util::kScheduleWorkStealing ? "WorkStealing"
+                                                 : "SharedCounter") +
+        (wait == sdk_util::kWaitSpinThenBlock ? "Spin" : "Block");
+  }
+  virtual const std::string Notes() {
+    std::string notes = mode == sdk_util::kScheduleWorkStealing ?
+        "per-worker deques with stealing" : "shared task counter";
+    notes += wait == sdk_util::kWaitSpinThenBlock ?
+        ", spin then block" : ", block";
+    return notes;
+  }
+  virtual void Report(const char* description) {
+    for (size_t i = 0; i < thread_counts_.size(); i++) {
+      const ThreadPoolStats& stats = stats_[i];
+      if (stats.dispatches == 0)
+        continue;
+      double dispatches = stats.dispatches;
+      char graph[128];
+      snprintf(graph, sizeof(graph), "Benchmark%s_Threads%d",
+               Name().c_str(), thread_counts_[i]);
+      printf("RESULT %s: %s= %.0f cells/s\n",
+             graph, description, best_cells_per_sec_[i]);
+      printf("RESULT %s_DispatchLatency: %s= {%.3f, %.3f} us\n",
+             graph, description, stats.dispatch_ns / dispatches / 1e3,
+             stats.max_dispatch_ns / 1e3);
+      printf("RESULT %s_WakeupLatency: %s= %.3f us\n",
+             graph, description, stats.wakeup_ns / dispatches / 1e3);
+      printf("RESULT %s_IdleTime: %s= %.3f us\n",
+             graph, description, stats.idle_ns / dispatches / 1e3);
+      printf("RESULT %s_Steals: %s= %.3f count\n",
+             graph, description, stats.steals / dispatches);
+      printf("RESULT %s_Chunks: %s= %.3f count\n",
+             graph, description, stats.chunks / dispatches);
+      printf("RESULT %s_SpinWakeups: %s= %.3f count\n",
+             graph, description, stats.spin_wakeups / dispatches);
+      printf("RESULT %s_BlockingWaits: %s= %.3f count\n",
+             graph, description, stats.blocking_waits / dispatches);
+    }
+  }
+ private:
+  Life life_;
+  std::vector<int> thread_counts_;
+  // Best of the suite's runs, and pool counters summed over the suite's
+  // runs, for each thread count.
+  std::vector<double> best_cells_per_sec_;
+  std::vector<ThreadPoolStats> stats_;
+};
+
+// Each thread count simulates about this many cells, so that small grids
+// run enough frames to be measurable.
+const double kCellsPerMeasurement = 1 << 27;
+
+// Runs one kernel on a size x size grid at 1, 2, 4 ... threads up to the
+// number of processors, and reports cells/sec for each thread count.  The
+// sizes registered below range from L1 resident to larger than the last
+// level cache.  The grid and pools only exist during Run(), so that the
+// large grids are not all allocated at once.
+template <LifeKernel kernel, int size>
+class BenchmarkLifeScaling : public Benchmark {
+ public:
+  BenchmarkLifeScaling()
+      : verified_(false),
+        thread_counts_(ThreadCounts(NumProcessors())),
+        best_cells_per_sec_(thread_counts_.size(), 0) {}
+  virtual int Run() {
+    if (!verified_) {
+      if (!VerifyKernel(kernel))
+        return -1;
+      verified_ = true;
+    }
+    Life life(size, size, kernel);
+    double cells_per_frame = (double) (size - 2) * (size - 2);
+    int frames = std::max(1, (int) (kCellsPerMeasurement / cells_per_frame));
+    for (size_t i = 0; i < thread_counts_.size(); i++) {
+      ThreadPool* workers =
+          CreateWorkers(thread_counts_[i], ThreadPoolOptions());
+      life.Reset();
+      double start_time = GetSeconds();
+      for (int f = 0; f < frames; f++)
+        life.SimulateFrame(workers);
+      double cells_per_sec = frames * cells_per_frame /
+          (GetSeconds() - start_time);
+      best_cells_per_sec_[i] = std::max(best_cells_per_sec_[i],
+                                        cells_per_sec);
+      delete workers;
+    }
+    return 0;
+  }
+  virtual const std::string Name() {
+    static const char* const kKernelNames[] = {
+        "Scalar", "Simd16", "Simd32", "BitPacked"};
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "Life%s_%dx%d",
+             kKernelNames[kernel], size, size);
+    return buffer;
+  }
+  virtual const std::string Notes() {
+    static const char* const kKernelNotes[] = {
+        "scalar version, 1 byte per cell",
+        "SIMD version, 16 cells per vector, 1 byte per cell",
+        "SIMD version, 32 cells per vector, 1 byte per cell",
+        "bit-packed version, 64 cells per word"};
+    std::string notes = kKernelNotes[kernel];
+#if defined(HAVE_SIMD)
+    if (kernel == kKernelSimd32)
+      notes += UseAvx2Kernel() ? ", AVX2" : ", generic vectors";
+#endif
+    return notes;
+  }
+  virtual void Report(const char* description) {
+    for (size_t i = 0; i < thread_counts_.size(); i++) {
+      printf("RESULT Benchmark%s_Threads%d: %s= %.0f cells/s\n",
+             Name().c_str(), thread_counts_[i], description,
+             best_cells_per_sec_[i]);
+    }
+  }
+ private:
+  bool verified_;
+  std::vector<int> thread_counts_;
+  // Best of the suite's runs for each thread count.
+  std::vector<double> best_cells_per_sec_;
 };
 
 }  // namespace
 
 // Register an instance to the list of benchmarks to be run.
 RegisterBenchmark<BenchmarkLife> benchmark_life;
+RegisterBenchmark<BenchmarkLifeScheduler<sdk_util::kScheduleSharedCounter,
+                                         sdk_util::kWaitBlock> >
+    benchmark_life_shared_counter_block;
+RegisterBenchmark<BenchmarkLifeScheduler<sdk_util::kScheduleSharedCounter,
+                                         sdk_util::kWaitSpinThenBlock> >
+    benchmark_life_shared_counter_spin;
+RegisterBenchmark<BenchmarkLifeScheduler<sdk_util::kScheduleWorkStealing,
+                                         sdk_util::kWaitBlock> >
+    benchmark_life_work_stealing_block;
+RegisterBenchmark<BenchmarkLifeScheduler<sdk_util::kScheduleWorkStealing,
+                                         sdk_util::kWaitSpinThenBlock> >
+    benchmark_life_work_stealing_spin;
+
+// Grid sizes: 64x64 fits in L1, 256x256 in L2, 1024x1024 in the last level
+// cache, and 8192x8192 (64 MiB per buffer in bytes) exceeds it.
+#define REGISTER_LIFE_SCALING(kernel, name) \
+    RegisterBenchmark<BenchmarkLifeScaling<kernel, 64> > name##_64; \
+    RegisterBenchmark<BenchmarkLifeScaling<kernel, 256> > name##_256; \
+    RegisterBenchmark<BenchmarkLifeScaling<kernel, 1024> > name##_1024; \
+    RegisterBenchmark<BenchmarkLifeScaling<kernel, 8192> > name##_8192;
+
+REGISTER_LIFE_SCALING(kKernelScalar, benchmark_life_scalar)
+#if defined(HAVE_SIMD)
+REGISTER_LIFE_SCALING(kKernelSimd16, benchmark_life_simd16)
+REGISTER_LIFE_SCALING(kKernelSimd32, benchmark_life_simd32)
+#endif
+REGISTER_LIFE_SCALING(kKernelBitPacked, benchmark_life_bit_packed)
+
+#undef REGISTER_LIFE_SCALING
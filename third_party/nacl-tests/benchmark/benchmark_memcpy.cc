@@ -0,0 +1,394 @@
+// Copyright 2016 The Native Client Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Throughput and latency matrix for the libc memcpy, memmove and memset
+// routines.  Each benchmark sweeps sizes from 1 byte to 64 MiB (16 MiB in a
+// 32-bit address space) and source and destination misalignments, and reports
+// GB/s and ns/call for every cell of the matrix.  Sizes up to 4 KiB sweep
+// every misalignment of 0..63 bytes; larger sizes use a sparse set of them.
+// The correctness of these routines on small buffers is covered by
+// MemCopyMoveTests in nacl-ported-tests; this only measures speed.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "native_client/tests/benchmark/framework.h"
+
+namespace {
+
+const size_t kPageSize = 0x1000;
+// NaCl sandboxes have 32-bit pointers and at most 4 GiB of address space, of
+// which the untrusted code may get as little as 1 GiB, so the buffers shrink
+// there.
+const bool kSmallAddressSpace = sizeof(void*) < 8;
+const size_t kMinSize = 1;
+const size_t kMaxSize = kSmallAddressSpace ? 16 << 20 : 64 << 20;
+// Misalignments are taken relative to a cache line.
+const int kMaxMisalign = 64;
+// Sizes up to this one sweep every misalignment in [0, kMaxMisalign);
+// larger ones use kSparseMisaligns to keep the run time reasonable.
+const size_t kFullSweepMaxSize = 4096;
+const int kSparseMisaligns[] = {0, 1, 3, 4, 7, 8, 15, 16, 31, 32, 48, 63};
+
+// The hot benchmarks call the routine repeatedly on the same buffers.  Each
+// cell moves roughly kTargetBytes, bounded by the iteration limits below.
+const size_t kTargetBytes = 1 << 20;
+const size_t kMinIterations = 2;
+const size_t kMaxIterations = 1 << 14;
+
+// The cold benchmarks walk through an arena that is larger than the last
+// level cache, so every call touches memory that was last used at least
+// kColdArenaSize bytes earlier.  Sizes that do not fit twice in the arena
+// explicitly evict the caches before each call instead.
+const size_t kColdArenaSize = kSmallAddressSpace ? 32 << 20 : 128 << 20;
+
+// Hot buffers must hold an overlapping memmove of kMaxSize, which spans
+// one and a half times the size.
+const size_t kHotBufferSize = kMaxSize + kMaxSize / 2 + 2 * kPageSize;
+
+enum Op { kMemcpy, kMemmoveForward, kMemmoveBackward, kMemset };
+enum Cache { kHot, kCold };
+
+INLINE size_t RoundUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+double GetNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keep the compiler from eliding or merging calls whose result is unused.
+INLINE void ClobberMemory(void* ptr) {
+  __asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+uint8_t* AllocateBuffer(size_t size) {
+  void* buffer = NULL;
+  if (posix_memalign(&buffer, kPageSize, size) != 0) {
+    fprintf(stderr, "Failed to allocate %zu bytes!\n", size);
+    exit(-1);
+  }
+  // Touch every page up front so page faults never show up in the timings.
+  for (size_t i = 0; i < size; i++)
+    static_cast<uint8_t*>(buffer)[i] = static_cast<uint8_t>(i);
+  return static_cast<uint8_t*>(buffer);
+}
+
+// Buffers shared by all benchmarks in this file, allocated on first use.
+struct Buffers {
+  Buffers()
+      : hot_a(AllocateBuffer(kHotBufferSize)),
+        hot_b(AllocateBuffer(kHotBufferSize)),
+        cold_arena(AllocateBuffer(kColdArenaSize)),
+        cold_cursor(0) {}
+  uint8_t* hot_a;
+  uint8_t* hot_b;
+  uint8_t* cold_arena;
+  size_t cold_cursor;
+};
+
+Buffers* GetBuffers() {
+  static Buffers* buffers = new Buffers();
+  return buffers;
+}
+
+// Write one word per cache line across the whole cold arena.  The arena is
+// larger than the last level cache, so this evicts any buffer a call is
+// about to use.
+void EvictCaches() {
+  volatile uint8_t* arena = GetBuffers()->cold_arena;
+  for (size_t i = 0; i < kColdArenaSize; i += kMaxMisalign)
+    arena[i] = static_cast<uint8_t>(i);
+}
+
+std::string FormatSize(size_t size) {
+  char buffer[32];
+  if (size >= (1 << 20) && size % (1 << 20) == 0)
+    snprintf(buffer, sizeof(buffer), "%zuMiB", size >> 20);
+  else if (size >= (1 << 10) && size % (1 << 10) == 0)
+    snprintf(buffer, sizeof(buffer), "%zuKiB", size >> 10);
+  else
+    snprintf(buffer, sizeof(buffer), "%zuB", size);
+  return buffer;
+}
+
+// One cell of the benchmark matrix.  best_ns is the fastest per-call time
+// observed across all of the suite's runs.
+struct Cell {
+  size_t size;
+  int src_misalign;
+  int dst_misalign;
+  double best_ns;
+};
+
+template <Op op, Cache cache>
+class BenchmarkMemory : public Benchmark {
+ public:
+  virtual const std::string Name() {
+    static const char* const kOpNames[] = {
+        "Memcpy", "MemmoveForward", "MemmoveBackward", "Memset"};
+    return std::string(kOpNames[op]) + (cache == kHot ? "Hot" : "Cold");
+  }
+
+  virtual const std::string Notes() {
+    std::string notes = cache == kHot ? "hot cache" : "cold cache";
+    if (op == kMemmoveForward)
+      notes += ", overlapping with dst below src";
+    else if (op == kMemmoveBackward)
+      notes += ", overlapping with dst above src";
+    return notes;
+  }
+
+  virtual int Run() {
+    if (cells_.empty())
+      BuildCells();
+    for (size_t i = 0; i < cells_.size(); i++) {
+      double ns = RunCell(cells_[i]);
+      if (ns < 0)
+        return -1;
+      if (cells_[i].best_ns < 0 || ns < cells_[i].best_ns)
+        cells_[i].best_ns = ns;
+    }
+    return 0;
+  }
+
+  virtual void Report(const char* description) {
+    for (size_t i = 0; i < cells_.size(); i++) {
+      const Cell& cell = cells_[i];
+      // Bytes read plus bytes written; memset only writes.
+      double bytes = op == kMemset ? cell.size : 2.0 * cell.size;
+      std::string graph = "Benchmark" + Name() + "_" + FormatSize(cell.size);
+      char misalign[32];
+      snprintf(misalign, sizeof(misalign), "_s%d_d%d",
+               cell.src_misalign, cell.dst_misalign);
+      graph += misalign;
+      printf("RESULT %s_GBps: %s= %.3f GB/s\n",
+             graph.c_str(), description, bytes / cell.best_ns);
+      printf("RESULT %s_NsPerCall: %s= %.3f ns\n",
+             graph.c_str(), description, cell.best_ns);
+    }
+  }
+
+ private:
+  void AddCell(size_t size, int src_misalign, int dst_misalign) {
+    Cell cell = {size, src_misalign, dst_misalign, -1};
+    cells_.push_back(cell);
+  }
+
+  // memcpy varies the source and destination misalignment independently and
+  // together.  memset has no source, and an overlapping memmove derives the
+  // source from the destination, so those only vary the destination.
+  void BuildCells() {
+    for (size_t size = kMinSize; size <= kMaxSize; size *= 2) {
+      std::vector<int> misaligns;
+      if (size <= kFullSweepMaxSize) {
+        for (int m = 0; m < kMaxMisalign; m++)
+          misaligns.push_back(m);
+      } else {
+        misaligns.assign(kSparseMisaligns,
+                         kSparseMisaligns + sizeof(kSparseMisaligns) /
+                                                sizeof(kSparseMisaligns[0]));
+      }
+      for (size_t i = 0; i < misaligns.size(); i++) {
+        int m = misaligns[i];
+        if (op == kMemcpy) {
+          AddCell(size, m, 0);
+          if (m != 0) {
+            AddCell(size, 0, m);
+            AddCell(size, m, m);
+          }
+        } else if (op == kMemset) {
+          AddCell(size, 0, m);
+        } else {
+          int shifted = (m + OverlapShift(size)) % kMaxMisalign;
+          if (op == kMemmoveForward)
+            AddCell(size, shifted, m);
+          else
+            AddCell(size, m, shifted);
+        }
+      }
+    }
+  }
+
+  // Distance between source and destination of an overlapping memmove.
+  // Large sizes keep it a multiple of the cache line so the source inherits
+  // the destination's misalignment.
+  static size_t OverlapShift(size_t size) {
+    if (size >= 2 * kMaxMisalign)
+      return (size / 2) & ~(kMaxMisalign - 1);
+    return size > 1 ? size / 2 : 1;
+  }
+
+  // Misalignment of the lower of the two overlapping memmove buffers.
+  static int LowMisalign(const Cell& cell) {
+    return op == kMemmoveForward ? cell.dst_misalign : cell.src_misalign;
+  }
+
+  // Number of bytes one call touches, including misalignment slack.
+  static size_t Footprint(size_t size) {
+    if (op == kMemcpy)
+      return 2 * (size + kMaxMisalign);
+    if (op == kMemset)
+      return size + kMaxMisalign;
+    return size + OverlapShift(size) + kMaxMisalign;
+  }
+
+  static INLINE void* Call(uint8_t* base, const Cell& cell) {
+    size_t size = cell.size;
+    if (op == kMemcpy) {
+      uint8_t* dst = base + size + kMaxMisalign + cell.dst_misalign;
+      return memcpy(dst, base + cell.src_misalign, size);
+    }
+    if (op == kMemset)
+      return memset(base + cell.dst_misalign, 0x5a, size);
+    size_t shift = OverlapShift(size);
+    uint8_t* low = base + LowMisalign(cell);
+    if (op == kMemmoveForward)
+      return memmove(low, low + shift, size);
+    return memmove(low + shift, low, size);
+  }
+
+  // Hot cells use hot_a for the memcpy source and every memmove and memset,
+  // and hot_b for the memcpy destination.
+  static INLINE void* CallHot(const Cell& cell) {
+    Buffers* buffers = GetBuffers();
+    if (op == kMemcpy) {
+      return memcpy(buffers->hot_b + cell.dst_misalign,
+                    buffers->hot_a + cell.src_misalign, cell.size);
+    }
+    return Call(buffers->hot_a, cell);
+  }
+
+  static size_t Iterations(size_t size) {
+    size_t iterations = kTargetBytes / size;
+    if (iterations < kMinIterations)
+      return kMinIterations;
+    if (iterations > kMaxIterations)
+      return kMaxIterations;
+    return iterations;
+  }
+
+  // Returns the mean ns/call for this cell, or -1 on a wrong result.
+  double RunCell(const Cell& cell) {
+    return cache == kHot ? RunHotCell(cell) : RunColdCell(cell);
+  }
+
+  double RunHotCell(const Cell& cell) {
+    size_t iterations = Iterations(cell.size);
+    // Warm the caches and check the result once before timing.
+    if (!Verify(cell))
+      return -1;
+    double start = GetNanoseconds();
+    for (size_t i = 0; i < iterations; i++)
+      ClobberMemory(CallHot(cell));
+    return (GetNanoseconds() - start) / iterations;
+  }
+
+  double RunColdCell(const Cell& cell) {
+    Buffers* buffers = GetBuffers();
+    size_t stride = RoundUp(Footprint(cell.size), kPageSize);
+    size_t slots = kColdArenaSize / stride;
+    if (slots < 2) {
+      // The buffers do not fit twice in the arena: use the hot buffers,
+      // evict before every call and time the calls one at a time.
+      size_t iterations = kMinIterations;
+      double total = 0;
+      for (size_t i = 0; i < iterations; i++) {
+        EvictCaches();
+        double start = GetNanoseconds();
+        ClobberMemory(CallHot(cell));
+        total += GetNanoseconds() - start;
+      }
+      buffers->cold_cursor = 0;
+      return total / iterations;
+    }
+    size_t iterations = Iterations(cell.size);
+    if (iterations > slots)
+      iterations = slots;
+    // Continue from where the previous cell stopped, so the memory used here
+    // was last touched a whole arena earlier.
+    size_t cursor = buffers->cold_cursor;
+    double start = GetNanoseconds();
+    for (size_t i = 0; i < iterations; i++) {
+      if (cursor + stride > kColdArenaSize)
+        cursor = 0;
+      ClobberMemory(Call(buffers->cold_arena + cursor, cell));
+      cursor += stride;
+    }
+    double ns = (GetNanoseconds() - start) / iterations;
+    buffers->cold_cursor = cursor;
+    return ns;
+  }
+
+  // Run one call on the hot buffers and check its result.  Overlapping
+  // memmove results are checked against a copy taken beforehand.
+  bool Verify(const Cell& cell) {
+    Buffers* buffers = GetBuffers();
+    size_t size = cell.size;
+    const uint8_t* expected = NULL;
+    uint8_t* dst = NULL;
+    if (op == kMemcpy) {
+      expected = buffers->hot_a + cell.src_misalign;
+      dst = buffers->hot_b + cell.dst_misalign;
+    } else if (op != kMemset) {
+      uint8_t* low = buffers->hot_a + LowMisalign(cell);
+      uint8_t* src = op == kMemmoveForward ? low + OverlapShift(size) : low;
+      dst = op == kMemmoveForward ? low : low + OverlapShift(size);
+      // Keep the copy in hot_b; hot memmove never touches it.
+      memcpy(buffers->hot_b, src, size);
+      expected = buffers->hot_b;
+    } else {
+      // Clear the range and the byte after it, so that a short or long
+      // memset shows up even though earlier cells left 0x5a behind.
+      dst = buffers->hot_a + cell.dst_misalign;
+      for (size_t i = 0; i <= size; i++)
+        dst[i] = 0;
+    }
+    void* ret = CallHot(cell);
+    if (ret != dst) {
+      fprintf(stderr, "%s: wrong return value %p != %p for size %zu\n",
+              Name().c_str(), ret, static_cast<void*>(dst), size);
+      return false;
+    }
+    bool ok = true;
+    if (op == kMemset) {
+      for (size_t i = 0; i < size && ok; i++)
+        ok = dst[i] == 0x5a;
+      ok = ok && dst[size] == 0;
+    } else {
+      ok = memcmp(dst, expected, size) == 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "%s: wrong contents for size %zu, s%d d%d\n",
+              Name().c_str(), size, cell.src_misalign, cell.dst_misalign);
+    }
+    return ok;
+  }
+
+  std::vector<Cell> cells_;
+};
+
+}  // namespace
+
+// Register an instance of each benchmark to the list of benchmarks to be run.
+RegisterBenchmark<BenchmarkMemory<kMemcpy, kHot> > benchmark_memcpy_hot;
+RegisterBenchmark<BenchmarkMemory<kMemcpy, kCold> > benchmark_memcpy_cold;
+RegisterBenchmark<BenchmarkMemory<kMemmoveForward, kHot> >
+    benchmark_memmove_forward_hot;
+RegisterBenchmark<BenchmarkMemory<kMemmoveForward, kCold> >
+    benchmark_memmove_forward_cold;
+RegisterBenchmark<BenchmarkMemory<kMemmoveBackward, kHot> >
+    benchmark_memmove_backward_hot;
+RegisterBenchmark<BenchmarkMemory<kMemmoveBackward, kCold> >
+    benchmark_memmove_backward_cold;
+RegisterBenchmark<BenchmarkMemory<kMemset, kHot> > benchmark_memset_hot;
+RegisterBenchmark<BenchmarkMemory<kMemset, kCold> > benchmark_memset_cold;
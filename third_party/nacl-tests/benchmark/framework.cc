@@ -66,6 +66,7 @@ int BenchmarkSuite::Run(const char* description, BenchmarkCallback callback,
     double range = times[2] - times[0];
     printf("RESULT Benchmark%s: %s= {%.6f, %.6f} seconds\n",
         name.c_str(), description, median, range);
+    Benchmarks()[i]->Report(description);
     printf("---------------------------------------------------------------\n");
     // Invoke an optional callback on each benchmark.
     if (callback)
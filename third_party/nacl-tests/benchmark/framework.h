@@ -19,7 +19,9 @@
 // Derive each benchmark (NBody, Life, etc.) from Benchmark class,
 // and provide Name() and Run() virtual functions.  Also provide optional
 // Notes() function to annotate benchmark with additional info, such as
-// scalar or SIMD version.
+// scalar or SIMD version.  Benchmarks that collect finer grained data than a
+// single wall time per Run() can override Report(), which is invoked once
+// after the timed runs to print additional RESULT lines.
 // The Run() method should perform the computation and return 0 for success. If
 // it returns a non-zero value, the benchmark suite will fail and return
 // EXIT_FAILURE from main().
@@ -27,6 +29,7 @@ class Benchmark {
  public:
   virtual const std::string Name() = 0;
   virtual const std::string Notes() { return ""; }
+  virtual void Report(const char* /* description */) {}
   virtual int Run() = 0;
 };
 
@@ -7,16 +7,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
 
 #include "native_client/tests/benchmark/thread_pool.h"
 
 namespace sdk_util {
 
+namespace {
+
+const size_t kCacheLineSize = 64;
+
+uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+inline void CpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ volatile("pause" ::: "memory");
+#else
+  __asm__ volatile("" ::: "memory");
+#endif
+}
+
+// A worker's deque of chunks is the range [begin, end) of chunk indices,
+// packed into one word so that the owner and thieves can both update it
+// with a single compare-and-swap.
+inline uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return ((uint64_t) end << 32) | begin;
+}
+
+inline uint32_t RangeBegin(uint64_t range) { return (uint32_t) range; }
+inline uint32_t RangeEnd(uint64_t range) { return (uint32_t) (range >> 32); }
+
+}  // namespace
+
+// Per-worker state, padded to a cache line so that workers updating their
+// own deque and counters do not slow each other down.  Array new does not
+// honor the alignment before C++17, so Init() allocates the array with
+// posix_memalign.
+struct ThreadPool::Worker {
+  ThreadPool* pool;
+  int index;
+  volatile uint64_t range;
+  uint32_t seen_generation;
+  uint64_t wakeup_ns;
+  uint64_t idle_ns;
+  uint64_t chunks;
+  uint64_t steals;
+  uint64_t spin_wakeups;
+  uint64_t blocking_waits;
+} __attribute__((aligned(kCacheLineSize)));
+
 // Initializes mutex, semaphores and a pool of threads.  If 0 is passed for
 // num_threads, all work will be performed on the dispatch thread.
 ThreadPool::ThreadPool(int num_threads)
-    : threads_(NULL), counter_(0), num_threads_(num_threads), exiting_(false),
-      user_data_(NULL), user_work_function_(NULL) {
+    : threads_(NULL), workers_(NULL), counter_(0), num_threads_(num_threads),
+      options_(), exiting_(false), user_data_(NULL),
+      user_work_function_(NULL) {
+  Init();
+}
+
+ThreadPool::ThreadPool(int num_threads, const ThreadPoolOptions& options)
+    : threads_(NULL), workers_(NULL), counter_(0), num_threads_(num_threads),
+      options_(options), exiting_(false), user_data_(NULL),
+      user_work_function_(NULL) {
+  Init();
+}
+
+void ThreadPool::Init() {
+  num_tasks_ = 0;
+  chunk_size_ = 1;
+  generation_ = 0;
+  done_count_ = 0;
+  dispatch_start_ns_ = 0;
+  stats_start_ns_ = 0;
+  memset(&stats_, 0, sizeof(stats_));
   if (num_threads_ > 0) {
     int status;
     status = sem_init(&work_sem_, 0, 0);
@@ -29,9 +99,22 @@ ThreadPool::ThreadPool(int num_threads)
       fprintf(stderr, "Failed to initialize semaphore!\n");
       exit(-1);
     }
+    void* workers;
+    if (posix_memalign(&workers, kCacheLineSize,
+                       num_threads_ * sizeof(Worker)) != 0) {
+      fprintf(stderr, "Failed to allocate workers!\n");
+      exit(-1);
+    }
+    workers_ = static_cast<Worker*>(workers);
+    for (int i = 0; i < num_threads_; i++) {
+      new (&workers_[i]) Worker();
+      workers_[i].pool = this;
+      workers_[i].index = i;
+    }
     threads_ = new pthread_t[num_threads_];
     for (int i = 0; i < num_threads_; i++) {
-      status = pthread_create(&threads_[i], NULL, WorkerThreadEntry, this);
+      status = pthread_create(&threads_[i], NULL, WorkerThreadEntry,
+                              &workers_[i]);
       if (0 != status) {
         fprintf(stderr, "Failed to create thread!\n");
         exit(-1);
@@ -45,17 +128,64 @@ ThreadPool::~ThreadPool() {
   if (num_threads_ > 0) {
     PostExitAndJoinAll();
     delete[] threads_;
+    for (int i = 0; i < num_threads_; i++)
+      workers_[i].~Worker();
+    free(workers_);
     sem_destroy(&done_sem_);
     sem_destroy(&work_sem_);
   }
 }
 
+// Sum the per-worker counters into the pool's totals.  Call this only from
+// the dispatch thread, between dispatches.
+void ThreadPool::GetStats(ThreadPoolStats* stats) {
+  *stats = stats_;
+  for (int i = 0; i < num_threads_; i++) {
+    stats->wakeup_ns += workers_[i].wakeup_ns;
+    stats->idle_ns += workers_[i].idle_ns;
+    stats->chunks += workers_[i].chunks;
+    stats->steals += workers_[i].steals;
+    stats->spin_wakeups += workers_[i].spin_wakeups;
+    stats->blocking_waits += workers_[i].blocking_waits;
+  }
+}
+
+void ThreadPool::ResetStats() {
+  memset(&stats_, 0, sizeof(stats_));
+  if (options_.collect_stats)
+    stats_start_ns_ = NowNs();
+  for (int i = 0; i < num_threads_; i++) {
+    workers_[i].wakeup_ns = 0;
+    workers_[i].idle_ns = 0;
+    workers_[i].chunks = 0;
+    workers_[i].steals = 0;
+    workers_[i].spin_wakeups = 0;
+    workers_[i].blocking_waits = 0;
+  }
+}
+
 // Setup work parameters.  This function is called from the dispatch thread,
 // when all worker threads are sleeping.
 void ThreadPool::Setup(int counter, WorkFunction work, void *data) {
   counter_ = counter;
   user_work_function_ = work;
   user_data_ = data;
+  num_tasks_ = counter;
+  done_count_ = 0;
+  if (options_.mode == kScheduleWorkStealing) {
+    chunk_size_ = options_.chunk_size;
+    if (chunk_size_ <= 0)
+      chunk_size_ = counter / (num_threads_ * 8);
+    if (chunk_size_ < 1)
+      chunk_size_ = 1;
+    // Give each worker a contiguous block of chunks.
+    uint32_t num_chunks = (counter + chunk_size_ - 1) / chunk_size_;
+    for (int i = 0; i < num_threads_; i++) {
+      uint32_t begin = (uint64_t) num_chunks * i / num_threads_;
+      uint32_t end = (uint64_t) num_chunks * (i + 1) / num_threads_;
+      workers_[i].range = PackRange(begin, end);
+    }
+  }
 }
 
 // Return decremented task counter.  This function
@@ -69,6 +199,7 @@ int ThreadPool::DecCounter() {
 // sleeping.
 void ThreadPool::PostExitAndJoinAll() {
   exiting_ = true;
+  __sync_add_and_fetch(&generation_, 1);
   // Wake up all the sleeping worker threads.
   for (int i = 0; i < num_threads_; ++i)
     sem_post(&work_sem_);
@@ -77,27 +208,131 @@ void ThreadPool::PostExitAndJoinAll() {
     pthread_join(threads_[i], &retval);
 }
 
+// Wait for the next dispatch, and return whether it was noticed while
+// spinning.  Every dispatch posts work_sem_ once per worker, so a worker
+// that noticed the new generation while spinning still takes its post; that
+// sem_wait() returns without blocking.
+bool ThreadPool::WaitForWork(Worker* worker) {
+  bool spun = false;
+  if (options_.wait == kWaitSpinThenBlock) {
+    for (int i = 0; i < options_.spin_count; i++) {
+      if (generation_ != worker->seen_generation) {
+        spun = true;
+        break;
+      }
+      CpuRelax();
+    }
+  }
+  sem_wait(&work_sem_);
+  worker->seen_generation = generation_;
+  return spun;
+}
+
+// Wait for all workers to finish the current dispatch.  As in
+// WaitForWork(), done_sem_ is always consumed once per worker.
+void ThreadPool::WaitForDone() {
+  if (options_.wait == kWaitSpinThenBlock) {
+    for (int i = 0; i < options_.spin_count; i++) {
+      if (__sync_add_and_fetch(&done_count_, 0) == num_threads_)
+        break;
+      CpuRelax();
+    }
+  }
+  for (int i = 0; i < num_threads_; i++)
+    sem_wait(&done_sem_);
+}
+
+// Shared counter scheduling: grab task indices one at a time.
+void ThreadPool::RunSharedCounter() {
+  while (true) {
+    // Grab a task index to work on from the counter.
+    int task_index = DecCounter();
+    if (task_index < 0)
+      break;
+    user_work_function_(task_index, user_data_);
+  }
+}
+
+void ThreadPool::RunChunk(Worker* worker, int chunk) {
+  int begin = chunk * chunk_size_;
+  int end = begin + chunk_size_;
+  if (end > num_tasks_)
+    end = num_tasks_;
+  for (int i = begin; i < end; i++)
+    user_work_function_(i, user_data_);
+  worker->chunks++;
+}
+
+// Work stealing scheduling: drain our own deque from the front, then steal
+// from the back of the other workers' deques until all of them are empty.
+// No chunks are added during a dispatch, so one pass that finds every deque
+// empty means the dispatch is finished.
+void ThreadPool::RunWorkStealing(Worker* worker) {
+  while (true) {
+    uint64_t range = worker->range;
+    uint32_t begin = RangeBegin(range);
+    uint32_t end = RangeEnd(range);
+    if (begin >= end)
+      break;
+    if (__sync_bool_compare_and_swap(&worker->range, range,
+                                     PackRange(begin + 1, end))) {
+      RunChunk(worker, begin);
+    }
+  }
+  for (int i = 1; i < num_threads_; i++) {
+    Worker* victim = &workers_[(worker->index + i) % num_threads_];
+    while (true) {
+      uint64_t range = victim->range;
+      uint32_t begin = RangeBegin(range);
+      uint32_t end = RangeEnd(range);
+      if (begin >= end)
+        break;
+      if (__sync_bool_compare_and_swap(&victim->range, range,
+                                       PackRange(begin, end - 1))) {
+        worker->steals++;
+        RunChunk(worker, end - 1);
+      }
+    }
+  }
+}
+
 // Main work loop - one for each worker thread.
-void ThreadPool::WorkLoop() {
+void ThreadPool::WorkLoop(Worker* worker) {
+  bool first_wait = true;
   while (true) {
     // Wait for work. If no work is availble, this thread will sleep here.
-    sem_wait(&work_sem_);
+    uint64_t wait_start = options_.collect_stats ? NowNs() : 0;
+    bool spun = WaitForWork(worker);
     if (exiting_) break;
-    while (true) {
-      // Grab a task index to work on from the counter.
-      int task_index = DecCounter();
-      if (task_index < 0)
-        break;
-      user_work_function_(task_index, user_data_);
+    if (spun)
+      worker->spin_wakeups++;
+    else
+      worker->blocking_waits++;
+    if (options_.collect_stats) {
+      uint64_t now = NowNs();
+      // Waiting for the first dispatch is start-up rather than idle time.
+      if (!first_wait) {
+        if (wait_start < stats_start_ns_)
+          wait_start = stats_start_ns_;
+        worker->idle_ns += now - wait_start;
+      }
+      worker->wakeup_ns += now - dispatch_start_ns_;
     }
+    first_wait = false;
+    if (options_.mode == kScheduleWorkStealing)
+      RunWorkStealing(worker);
+    else
+      RunSharedCounter();
     // Post to dispatch thread work is done.
+    __sync_add_and_fetch(&done_count_, 1);
     sem_post(&done_sem_);
   }
 }
 
 // pthread entry point for a worker thread.
-void* ThreadPool::WorkerThreadEntry(void* thiz) {
-  static_cast<ThreadPool*>(thiz)->WorkLoop();
+void* ThreadPool::WorkerThreadEntry(void* data) {
+  Worker* worker = static_cast<Worker*>(data);
+  worker->pool->WorkLoop(worker);
   return NULL;
 }
 
@@ -106,6 +341,7 @@ void* ThreadPool::WorkerThreadEntry(void* thiz) {
 void ThreadPool::DispatchMany(int num_tasks, WorkFunction work, void* data) {
   // On entry, all worker threads are sleeping.
   Setup(num_tasks, work, data);
+  __sync_add_and_fetch(&generation_, 1);
 
   // Wake up the worker threads & have them process tasks.
   for (int i = 0; i < num_threads_; i++)
@@ -113,9 +349,8 @@ void ThreadPool::DispatchMany(int num_tasks, WorkFunction work, void* data) {
 
   // Worker threads are now awake and busy.
 
-  // This dispatch thread will now sleep-wait for the worker threads to finish.
-  for (int i = 0; i < num_threads_; i++)
-    sem_wait(&done_sem_);
+  // This dispatch thread will now wait for the worker threads to finish.
+  WaitForDone();
   // On exit, all tasks are done and all worker threads are sleeping again.
 }
 
@@ -129,10 +364,19 @@ void ThreadPool::DispatchHere(int num_tasks, WorkFunction work, void* data) {
 // one or more threads for each task.
 // Note: This function will block until all work has completed.
 void ThreadPool::Dispatch(int num_tasks, WorkFunction work, void* data) {
+  if (options_.collect_stats)
+    dispatch_start_ns_ = NowNs();
   if (num_threads_ > 0)
     DispatchMany(num_tasks, work, data);
   else
     DispatchHere(num_tasks, work, data);
+  stats_.dispatches++;
+  if (options_.collect_stats) {
+    uint64_t elapsed = NowNs() - dispatch_start_ns_;
+    stats_.dispatch_ns += elapsed;
+    if (elapsed > stats_.max_dispatch_ns)
+      stats_.max_dispatch_ns = elapsed;
+  }
 }
 
 }  // namespace sdk_util
@@ -16,6 +16,63 @@ namespace sdk_util {
 // typdef helper for work function
 typedef void (*WorkFunction)(int task_index, void* data);
 
+// How Dispatch(..) hands out tasks to the worker threads.
+enum SchedulerMode {
+  // Workers take task indices one at a time from a single shared counter.
+  kScheduleSharedCounter,
+  // Tasks are grouped into chunks of consecutive indices, and the chunks are
+  // spread over per-worker deques.  A worker pops chunks from the front of
+  // its own deque, and when that is empty steals from the back of others.
+  kScheduleWorkStealing
+};
+
+// How idle threads wait for the next Dispatch(..) or for workers to finish.
+enum WaitMode {
+  // Block on a semaphore straight away.
+  kWaitBlock,
+  // Spin for up to spin_count polls first, so that back to back dispatches
+  // do not have to go through the kernel.
+  kWaitSpinThenBlock
+};
+
+struct ThreadPoolOptions {
+  ThreadPoolOptions()
+      : mode(kScheduleSharedCounter), chunk_size(0), wait(kWaitBlock),
+        spin_count(20000), collect_stats(false) {}
+  SchedulerMode mode;
+  // Tasks per chunk in kScheduleWorkStealing mode.  0 picks a size giving
+  // each worker about 8 chunks per dispatch.
+  int chunk_size;
+  WaitMode wait;
+  int spin_count;
+  // Timestamps every dispatch and wakeup; adds two clock reads per worker
+  // per dispatch.
+  bool collect_stats;
+};
+
+// Counters accumulated since construction or the last ResetStats().
+// Times are in nanoseconds and are only collected with collect_stats.
+struct ThreadPoolStats {
+  uint64_t dispatches;
+  // Wall time spent in Dispatch(..), including the work itself.
+  uint64_t dispatch_ns;
+  uint64_t max_dispatch_ns;
+  // Sum over workers of the delay from the start of Dispatch(..) until the
+  // worker started running tasks.
+  uint64_t wakeup_ns;
+  // Sum over workers of the time spent waiting for work between dispatches.
+  // The wait for the first dispatch, and time before ResetStats(), are not
+  // counted.
+  uint64_t idle_ns;
+  // Chunks run, and how many of them were stolen from another worker.
+  uint64_t chunks;
+  uint64_t steals;
+  // Worker waits for a dispatch that ended while spinning, and ones that had
+  // to block.  The wake to exit is not counted.
+  uint64_t spin_wakeups;
+  uint64_t blocking_waits;
+};
+
 // ThreadPool is a class to manage num_threads and assign
 // them num_tasks of work at a time. Each call
 // to Dispatch(..) will block until all tasks complete.
@@ -26,21 +83,42 @@ class ThreadPool {
  public:
   void Dispatch(int num_tasks, WorkFunction work, void* data);
   explicit ThreadPool(int num_threads);
+  ThreadPool(int num_threads, const ThreadPoolOptions& options);
   ~ThreadPool();
+  void GetStats(ThreadPoolStats* stats);
+  void ResetStats();
  private:
+  struct Worker;
+  void Init();
   int DecCounter();
   void Setup(int counter, WorkFunction work, void* data);
   void DispatchMany(int num_tasks, WorkFunction work, void* data);
   void DispatchHere(int num_tasks, WorkFunction work, void* data);
-  void WorkLoop();
+  void WorkLoop(Worker* worker);
+  void RunSharedCounter();
+  void RunWorkStealing(Worker* worker);
+  void RunChunk(Worker* worker, int chunk);
+  bool WaitForWork(Worker* worker);
+  void WaitForDone();
   static void* WorkerThreadEntry(void* data);
   void PostExitAndJoinAll();
   pthread_t* threads_;
+  Worker* workers_;
   int32_t counter_;
   const int num_threads_;
+  const ThreadPoolOptions options_;
   bool exiting_;
   void* user_data_;
   WorkFunction user_work_function_;
+  int num_tasks_;
+  int chunk_size_;
+  // Bumped by every dispatch so that spinning workers notice new work.
+  volatile uint32_t generation_;
+  // Workers that finished the current dispatch.
+  int32_t done_count_;
+  uint64_t dispatch_start_ns_;
+  uint64_t stats_start_ns_;
+  ThreadPoolStats stats_;
   sem_t work_sem_;
   sem_t done_sem_;
 };
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Virtual memory benchmarks.  TestMmapAnonymous in perf_test_basics.cc
+ * times one 64 KiB map/unmap; these cover the rest of what large buffer
+ * allocation costs:
+ *   - mmap/munmap of 4 KiB to 1 GiB,
+ *   - first touch page faults, from one thread and from several,
+ *   - MAP_POPULATE, MADV_HUGEPAGE and MADV_DONTNEED, where they exist,
+ *   - mprotect toggling,
+ *   - munmap while other threads are running, which needs TLB
+ *     shootdowns on multiprocessor systems.
+ *
+ * Results are printed as "RESULT" lines for Buildbot.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "native_client/src/include/nacl_assert.h"
+#include "native_client/tests/mmap/mmap_test_util.h"
+
+
+/* Region used for the page fault and madvise tests. */
+static const size_t kTouchSize = 256 << 20;
+static const size_t kHugePageSize = 2 << 20;
+/* Region unmapped in the shootdown test, small so that the cost is
+   dominated by the shootdown rather than by freeing pages. */
+static const size_t kShootdownPages = 16;
+static const int kShootdownIterations = 2000;
+static const int kMprotectIterations = 20000;
+
+static const char *g_description = "time";
+static size_t g_page_size;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &ts), 0);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_result(const char *graph, double value, const char *units) {
+  printf("RESULT %s: %s= %.3f %s\n", graph, g_description, value, units);
+}
+
+static void size_label(size_t size, char *buf, size_t buf_size) {
+  if (size >= (1 << 30))
+    snprintf(buf, buf_size, "%zuGiB", size >> 30);
+  else if (size >= (1 << 20))
+    snprintf(buf, buf_size, "%zuMiB", size >> 20);
+  else
+    snprintf(buf, buf_size, "%zuKiB", size >> 10);
+}
+
+/* Returns NULL rather than failing, since large sizes may not fit. */
+static char *map_anonymous(size_t size, int extra_flags) {
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_PRIVATE | extra_flags, -1, 0);
+  if (addr == MAP_FAILED)
+    return NULL;
+  return (char *) addr;
+}
+
+/*
+ * Maps size bytes aligned to alignment, by over-allocating and unmapping
+ * the excess on both sides.
+ */
+static char *map_aligned(size_t size, size_t alignment) {
+  char *addr = map_anonymous(size + alignment, 0);
+  if (addr == NULL)
+    return NULL;
+  uintptr_t start = ((uintptr_t) addr + alignment - 1) & ~(alignment - 1);
+  size_t head = start - (uintptr_t) addr;
+  if (head != 0)
+    ASSERT_EQ(munmap(addr, head), 0);
+  size_t tail = alignment - head;
+  if (tail != 0)
+    ASSERT_EQ(munmap((char *) start + size, tail), 0);
+  return (char *) start;
+}
+
+/* Writes one byte per page, faulting each page in. */
+static void touch_pages(char *addr, size_t size) {
+  for (size_t offset = 0; offset < size; offset += g_page_size)
+    ((volatile char *) addr)[offset] = 1;
+}
+
+static void report_touch(const char *name, size_t size, uint64_t elapsed) {
+  char graph[128];
+  double seconds = elapsed / 1e9;
+  snprintf(graph, sizeof(graph), "MmapFirstTouch%s_PagesPerSec", name);
+  print_result(graph, (size / g_page_size) / seconds, "pages/s");
+  snprintf(graph, sizeof(graph), "MmapFirstTouch%s_GBps", name);
+  print_result(graph, size / seconds / 1e9, "GB/s");
+}
+
+/*
+ * mmap+munmap pairs of untouched memory at 4 KiB, 16 KiB ... 1 GiB.  The
+ * iteration count shrinks with the size, and the sweep stops at the first
+ * size that cannot be mapped, e.g. on a 32-bit sandbox.
+ */
+static void test_mmap_munmap_sizes(void) {
+  /* Listed rather than computed, so that no step overflows a 32-bit size_t. */
+  static const size_t kMapSizes[] = {
+    4 << 10, 16 << 10, 64 << 10, 256 << 10,
+    1 << 20, 4 << 20, 16 << 20, 64 << 20, 256 << 20, 1 << 30
+  };
+  /* Bytes mapped per size, before clamping the iteration count. */
+  const uint64_t kMapBudget = (uint64_t) 64 << 30;
+  printf("test_mmap_munmap_sizes\n");
+  for (size_t s = 0; s < sizeof(kMapSizes) / sizeof(kMapSizes[0]); s++) {
+    size_t size = kMapSizes[s];
+    uint64_t budget_iterations = kMapBudget / size;
+    int iterations = budget_iterations > 4096 ? 4096 : (int) budget_iterations;
+    if (iterations < 16)
+      iterations = 16;
+    char *first = map_anonymous(size, 0);
+    if (first == NULL) {
+      printf("  stopping at %zu bytes: mmap failed\n", size);
+      break;
+    }
+    assert_page_is_allocated(first);
+    ASSERT_EQ(munmap(first, size), 0);
+
+    uint64_t map_ns = 0;
+    uint64_t unmap_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+      uint64_t t0 = now_ns();
+      char *addr = map_anonymous(size, 0);
+      uint64_t t1 = now_ns();
+      ASSERT_NE(addr, NULL);
+      ASSERT_EQ(munmap(addr, size), 0);
+      map_ns += t1 - t0;
+      unmap_ns += now_ns() - t1;
+    }
+    char label[32];
+    char graph[128];
+    size_label(size, label, sizeof(label));
+    snprintf(graph, sizeof(graph), "MmapAnonymous_%s", label);
+    print_result(graph, (double) map_ns / iterations / 1000, "us");
+    snprintf(graph, sizeof(graph), "MunmapAnonymous_%s", label);
+    print_result(graph, (double) unmap_ns / iterations / 1000, "us");
+  }
+}
+
+/*
+ * First touch of every page of kTouchSize bytes, plain and with each of
+ * the ways of avoiding or batching the faults.
+ */
+static void test_first_touch(void) {
+  printf("test_first_touch\n");
+  char *addr = map_anonymous(kTouchSize, 0);
+  ASSERT_NE(addr, NULL);
+  uint64_t start = now_ns();
+  touch_pages(addr, kTouchSize);
+  report_touch("", kTouchSize, now_ns() - start);
+
+#if defined(MADV_DONTNEED)
+  /*
+   * Dropping the pages and faulting them back in is what a freeing
+   * allocator that keeps its address space costs on reuse.
+   */
+  start = now_ns();
+  ASSERT_EQ(madvise(addr, kTouchSize, MADV_DONTNEED), 0);
+  uint64_t elapsed = now_ns() - start;
+  char label[32];
+  char graph[128];
+  size_label(kTouchSize, label, sizeof(label));
+  snprintf(graph, sizeof(graph), "MadviseDontneed_%s", label);
+  print_result(graph, elapsed / 1000.0, "us");
+  start = now_ns();
+  touch_pages(addr, kTouchSize);
+  report_touch("AfterDontneed", kTouchSize, now_ns() - start);
+#else
+  printf("  MADV_DONTNEED not available\n");
+#endif
+  ASSERT_EQ(munmap(addr, kTouchSize), 0);
+
+#if defined(MAP_POPULATE)
+  /* The faults are taken inside mmap, so time both together. */
+  start = now_ns();
+  addr = map_anonymous(kTouchSize, MAP_POPULATE);
+  ASSERT_NE(addr, NULL);
+  touch_pages(addr, kTouchSize);
+  report_touch("Populate", kTouchSize, now_ns() - start);
+  ASSERT_EQ(munmap(addr, kTouchSize), 0);
+#else
+  printf("  MAP_POPULATE not available\n");
+#endif
+
+#if defined(MADV_HUGEPAGE)
+  addr = map_aligned(kTouchSize, kHugePageSize);
+  ASSERT_NE(addr, NULL);
+  if (madvise(addr, kTouchSize, MADV_HUGEPAGE) == 0) {
+    start = now_ns();
+    touch_pages(addr, kTouchSize);
+    report_touch("Hugepage", kTouchSize, now_ns() - start);
+  } else {
+    printf("  madvise(MADV_HUGEPAGE) failed\n");
+  }
+  ASSERT_EQ(munmap(addr, kTouchSize), 0);
+#else
+  printf("  MADV_HUGEPAGE not available\n");
+#endif
+}
+
+struct touch_arg {
+  char *addr;
+  size_t size;
+};
+
+static void *touch_thread(void *arg) {
+  struct touch_arg *touch = (struct touch_arg *) arg;
+  touch_pages(touch->addr, touch->size);
+  return NULL;
+}
+
+static std::vector<int> thread_counts(void) {
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = nprocs > 1 ? nprocs : 1;
+  std::vector<int> counts;
+  for (int n = 1; n < max_threads; n *= 2)
+    counts.push_back(n);
+  counts.push_back(max_threads);
+  return counts;
+}
+
+/*
+ * Threads faulting in disjoint slices of one mapping at once, which
+ * contend on the address space lock.
+ */
+static void test_parallel_first_touch(void) {
+  printf("test_parallel_first_touch\n");
+  std::vector<int> counts = thread_counts();
+  for (size_t c = 0; c < counts.size(); c++) {
+    int nthreads = counts[c];
+    char *addr = map_anonymous(kTouchSize, 0);
+    ASSERT_NE(addr, NULL);
+    size_t pages_per_thread = kTouchSize / g_page_size / nthreads;
+    std::vector<struct touch_arg> args(nthreads);
+    std::vector<pthread_t> tids(nthreads);
+    uint64_t start = now_ns();
+    for (int i = 0; i < nthreads; i++) {
+      args[i].addr = addr + i * pages_per_thread * g_page_size;
+      args[i].size = pages_per_thread * g_page_size;
+      ASSERT_EQ(pthread_create(&tids[i], NULL, touch_thread, &args[i]), 0);
+    }
+    for (int i = 0; i < nthreads; i++)
+      ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+    uint64_t elapsed = now_ns() - start;
+    ASSERT_EQ(munmap(addr, kTouchSize), 0);
+
+    char name[32];
+    snprintf(name, sizeof(name), "Parallel_Threads%d", nthreads);
+    report_touch(name, pages_per_thread * nthreads * g_page_size, elapsed);
+  }
+}
+
+/*
+ * Cost of one mprotect call switching a touched region between read-only
+ * and read-write, as a JIT or a garbage collector's write barrier does.
+ */
+static void test_mprotect_toggle(void) {
+  printf("test_mprotect_toggle\n");
+  const size_t kPageCounts[] = { 1, 64 };
+  for (size_t p = 0; p < sizeof(kPageCounts) / sizeof(kPageCounts[0]); p++) {
+    size_t size = kPageCounts[p] * g_page_size;
+    char *addr = map_anonymous(size, 0);
+    ASSERT_NE(addr, NULL);
+    touch_pages(addr, size);
+    uint64_t start = now_ns();
+    for (int i = 0; i < kMprotectIterations; i++) {
+      ASSERT_EQ(mprotect(addr, size, PROT_READ), 0);
+      ASSERT_EQ(mprotect(addr, size, PROT_READ | PROT_WRITE), 0);
+    }
+    uint64_t elapsed = now_ns() - start;
+    ASSERT_EQ(munmap(addr, size), 0);
+
+    char graph[128];
+    snprintf(graph, sizeof(graph), "MprotectToggle_%zuPages", kPageCounts[p]);
+    print_result(graph, (double) elapsed / (2 * kMprotectIterations), "ns");
+  }
+}
+
+struct busy_arg {
+  volatile bool *stop;
+  char *buffer;
+};
+
+/*
+ * Keeps a thread running in this address space so that munmap on another
+ * CPU has to shoot down its TLB entries.
+ */
+static void *busy_thread(void *arg) {
+  struct busy_arg *busy = (struct busy_arg *) arg;
+  while (!*busy->stop)
+    touch_pages(busy->buffer, g_page_size);
+  return NULL;
+}
+
+/*
+ * Map, touch and unmap kShootdownPages pages on the main thread while 0,
+ * 1, 3 ... other threads are running, timing the munmap.
+ */
+static void test_munmap_shootdown(void) {
+  printf("test_munmap_shootdown\n");
+  std::vector<int> counts = thread_counts();
+  for (size_t c = 0; c < counts.size(); c++) {
+    /* The main thread is one of the counted threads. */
+    int nbusy = counts[c] - 1;
+    volatile bool stop = false;
+    std::vector<struct busy_arg> args(nbusy);
+    std::vector<pthread_t> tids(nbusy);
+    for (int i = 0; i < nbusy; i++) {
+      args[i].stop = &stop;
+      args[i].buffer = map_anonymous(g_page_size, 0);
+      ASSERT_NE(args[i].buffer, NULL);
+      ASSERT_EQ(pthread_create(&tids[i], NULL, busy_thread, &args[i]), 0);
+    }
+
+    size_t size = kShootdownPages * g_page_size;
+    uint64_t unmap_ns = 0;
+    for (int i = 0; i < kShootdownIterations; i++) {
+      char *addr = map_anonymous(size, 0);
+      ASSERT_NE(addr, NULL);
+      touch_pages(addr, size);
+      uint64_t start = now_ns();
+      ASSERT_EQ(munmap(addr, size), 0);
+      unmap_ns += now_ns() - start;
+    }
+
+    stop = true;
+    for (int i = 0; i < nbusy; i++) {
+      ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+      ASSERT_EQ(munmap(args[i].buffer, g_page_size), 0);
+    }
+
+    char graph[128];
+    snprintf(graph, sizeof(graph), "MunmapShootdown_BusyThreads%d", nbusy);
+    print_result(graph, (double) unmap_ns / kShootdownIterations / 1000, "us");
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 2)
+    g_description = argv[1];
+  g_page_size = getpagesize();
+
+  /* Turn off stdout buffering to aid debugging. */
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  test_mmap_munmap_sizes();
+  test_first_touch();
+  test_parallel_first_touch();
+  test_mprotect_toggle();
+  test_munmap_shootdown();
+  return 0;
+}
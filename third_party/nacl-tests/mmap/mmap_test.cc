@@ -18,6 +18,7 @@
 
 #include "native_client/src/include/nacl_assert.h"
 #include "native_client/src/include/nacl/nacl_exception.h"
+#include "native_client/tests/mmap/mmap_test_util.h"
 
 
 #define PRINT_HEADER 0
@@ -134,22 +135,6 @@ static void assert_addr_is_unwritable(volatile char *addr, char value) {
   assert(rc == 0);
 }
 
-static void assert_page_is_allocated(void *addr) {
-  const int kPageSize = getpagesize();
-  assert(((uintptr_t) addr & (kPageSize - 1)) == 0);
-  /*
-   * Try mapping at addr without MAP_FIXED.  If something is already
-   * mapped there, the system will pick another address.  Otherwise,
-   * we will get the address we asked for.
-   */
-  void *result = mmap(addr, kPageSize, PROT_READ | PROT_WRITE,
-                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-  assert(result != MAP_FAILED);
-  assert(result != addr);
-  int rc = munmap(result, kPageSize);
-  assert(rc == 0);
-}
-
 /*
  * function test*()
  *
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef NATIVE_CLIENT_TESTS_MMAP_MMAP_TEST_UTIL_H_
+#define NATIVE_CLIENT_TESTS_MMAP_MMAP_TEST_UTIL_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Mapping helpers shared by mmap_test.cc and mmap_benchmark.cc. */
+
+static inline void assert_page_is_allocated(void *addr) {
+  const int kPageSize = getpagesize();
+  assert(((uintptr_t) addr & (kPageSize - 1)) == 0);
+  /*
+   * Try mapping at addr without MAP_FIXED.  If something is already
+   * mapped there, the system will pick another address.  Otherwise,
+   * we will get the address we asked for.
+   */
+  void *result = mmap(addr, kPageSize, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  assert(result != MAP_FAILED);
+  assert(result != addr);
+  int rc = munmap(result, kPageSize);
+  assert(rc == 0);
+}
+
+#endif  // NATIVE_CLIENT_TESTS_MMAP_MMAP_TEST_UTIL_H_
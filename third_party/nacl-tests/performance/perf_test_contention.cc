@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2016 The Native Client Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Contended synchronization benchmarks.  perf_test_threads.cc only measures
+// uncontended operations; these run each primitive at 2, 4 ... N threads and
+// report throughput, latency histograms and fairness, i.e. the ratio of the
+// most to the fewest operations completed by any one thread.
+//
+// The rwlock reader wakeup scenario follows test_multiple_reader_wakeup in
+// tests/threads/rwlock_test.c, and the semaphore scenarios follow the
+// posting threads of TestSemNormalOperation in semaphore_tests.cc.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "native_client/src/include/nacl_assert.h"
+#include "native_client/src/include/nacl_macros.h"
+#include "native_client/tests/performance/perf_test_compat_osx.h"
+
+
+namespace {
+
+// How long each scenario runs at each thread count.
+const int kRunTimeMicroseconds = 250 * 1000;
+// Number of increments done while holding an exclusive lock.
+const int kCriticalSectionWork = 16;
+// How long the rwlock writer holds the lock so that readers queue up behind
+// it.  As in rwlock_test.c there is no way to know that they have.
+const uint64_t kWriterHoldNs = 50 * 1000;
+// Bound on outstanding posts in the semaphore fan-in scenario.
+const int kFanInCredits = 64;
+
+uint64_t NowNs() {
+  struct timespec ts;
+  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &ts), 0);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Latency histogram with power of two buckets: bucket b counts values in
+// [2^b, 2^(b+1)) nanoseconds, and bucket 0 also counts 0.
+class Histogram {
+ public:
+  static const int kBuckets = 40;
+
+  Histogram() { memset(counts_, 0, sizeof(counts_)); }
+
+  void Add(uint64_t ns) {
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (ns >> (bucket + 1)) != 0)
+      bucket++;
+    counts_[bucket]++;
+  }
+
+  void Merge(const Histogram &other) {
+    for (int i = 0; i < kBuckets; i++)
+      counts_[i] += other.counts_[i];
+  }
+
+  uint64_t Total() const {
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; i++)
+      total += counts_[i];
+    return total;
+  }
+
+  // Upper bound of the bucket containing the given quantile.
+  uint64_t Quantile(double q) const {
+    uint64_t total = Total();
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen > 0 && seen >= q * total)
+        return (uint64_t) 2 << i;
+    }
+    return 0;
+  }
+
+  void Print(const char *label) const {
+    if (Total() == 0)
+      return;
+    printf("  %s (ns):", label);
+    for (int i = 0; i < kBuckets; i++) {
+      if (counts_[i] != 0) {
+        printf(" [%" PRIu64 ",%" PRIu64 "):%" PRIu64,
+               i == 0 ? 0 : (uint64_t) 1 << i, (uint64_t) 2 << i, counts_[i]);
+      }
+    }
+    printf("\n");
+  }
+
+ private:
+  uint64_t counts_[kBuckets];
+};
+
+// Per-thread results, padded so that threads do not share cache lines.
+struct ThreadStats {
+  ThreadStats() : ops(0) {}
+  uint64_t ops;
+  // Time spent in the acquire or wait call.
+  Histogram wait;
+  // Time from one thread releasing or posting until another thread
+  // acquired or woke up.
+  Histogram handoff;
+} __attribute__((aligned(64)));
+
+class ContentionTest {
+ public:
+  virtual ~ContentionTest() {}
+  virtual void Setup(int nthreads) { UNREFERENCED_PARAMETER(nthreads); }
+  virtual void Teardown() {}
+  // Runs on each of the nthreads threads until *stop is set.
+  virtual void RunThread(int index, ThreadStats *stats,
+                         volatile bool *stop) = 0;
+  // Called from the main thread after setting *stop, to wake up threads
+  // that are blocked.
+  virtual void WakeAll() {}
+  // Scenarios where thread 0 plays a different role from the others return
+  // 1, so that throughput and fairness only count the other threads.
+  virtual int FirstPeerThread() { return 0; }
+};
+
+INLINE void CriticalSection(volatile int *counter) {
+  for (int i = 0; i < kCriticalSectionWork; i++)
+    (*counter)++;
+}
+
+// Exclusive lock/unlock of a pthread mutex of the given type.  A recursive
+// mutex is locked a second time while held, as when a locked module calls
+// back into itself, so that its owner check and lock count are exercised.
+template <int type>
+class TestMutex : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    UNREFERENCED_PARAMETER(nthreads);
+    pthread_mutexattr_t attr;
+    ASSERT_EQ(pthread_mutexattr_init(&attr), 0);
+    ASSERT_EQ(pthread_mutexattr_settype(&attr, type), 0);
+    ASSERT_EQ(pthread_mutex_init(&mutex_, &attr), 0);
+    ASSERT_EQ(pthread_mutexattr_destroy(&attr), 0);
+    last_owner_ = -1;
+    last_release_ = 0;
+    counter_ = 0;
+  }
+
+  virtual void Teardown() {
+    ASSERT_EQ(pthread_mutex_destroy(&mutex_), 0);
+  }
+
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    while (!*stop) {
+      uint64_t start = NowNs();
+      ASSERT_EQ(pthread_mutex_lock(&mutex_), 0);
+      uint64_t acquired = NowNs();
+      stats->wait.Add(acquired - start);
+      if (last_owner_ >= 0 && last_owner_ != index)
+        stats->handoff.Add(acquired - last_release_);
+      if (type == PTHREAD_MUTEX_RECURSIVE) {
+        ASSERT_EQ(pthread_mutex_lock(&mutex_), 0);
+        CriticalSection(&counter_);
+        ASSERT_EQ(pthread_mutex_unlock(&mutex_), 0);
+      } else {
+        CriticalSection(&counter_);
+      }
+      last_owner_ = index;
+      last_release_ = NowNs();
+      ASSERT_EQ(pthread_mutex_unlock(&mutex_), 0);
+      stats->ops++;
+    }
+  }
+
+ private:
+  pthread_mutex_t mutex_;
+  int last_owner_;
+  uint64_t last_release_;
+  volatile int counter_;
+};
+
+// A mix of rdlock and wrlock on one rwlock; read_percent of the operations
+// are reads.  Handoff latency is only meaningful for writers.
+template <int read_percent>
+class TestRwLockMix : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    UNREFERENCED_PARAMETER(nthreads);
+    ASSERT_EQ(pthread_rwlock_init(&rwlock_, NULL), 0);
+    last_writer_ = -1;
+    last_release_ = 0;
+    counter_ = 0;
+  }
+
+  virtual void Teardown() {
+    ASSERT_EQ(pthread_rwlock_destroy(&rwlock_), 0);
+  }
+
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    unsigned seed = index + 1;
+    while (!*stop) {
+      bool read = (int) (rand_r(&seed) % 100) < read_percent;
+      uint64_t start = NowNs();
+      if (read) {
+        ASSERT_EQ(pthread_rwlock_rdlock(&rwlock_), 0);
+        stats->wait.Add(NowNs() - start);
+        int value = counter_;
+        UNREFERENCED_PARAMETER(value);
+      } else {
+        ASSERT_EQ(pthread_rwlock_wrlock(&rwlock_), 0);
+        uint64_t acquired = NowNs();
+        stats->wait.Add(acquired - start);
+        if (last_writer_ >= 0 && last_writer_ != index)
+          stats->handoff.Add(acquired - last_release_);
+        CriticalSection(&counter_);
+        last_writer_ = index;
+        last_release_ = NowNs();
+      }
+      ASSERT_EQ(pthread_rwlock_unlock(&rwlock_), 0);
+      stats->ops++;
+    }
+  }
+
+ private:
+  pthread_rwlock_t rwlock_;
+  int last_writer_;
+  uint64_t last_release_;
+  volatile int counter_;
+};
+
+// Thread 0 takes the write lock, lets the other threads block in rdlock,
+// and releases it.  Handoff latency is the time from the release until
+// each reader acquired the lock.
+class TestRwLockReaderWakeup : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    ASSERT_EQ(pthread_rwlock_init(&rwlock_, NULL), 0);
+    nreaders_ = nthreads - 1;
+    round_ = 0;
+    acks_ = 0;
+    release_time_ = 0;
+  }
+
+  virtual void Teardown() {
+    ASSERT_EQ(pthread_rwlock_destroy(&rwlock_), 0);
+  }
+
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    if (index == 0) {
+      while (!*stop) {
+        ASSERT_EQ(pthread_rwlock_wrlock(&rwlock_), 0);
+        acks_ = 0;
+        __sync_fetch_and_add(&round_, 1);
+        uint64_t hold_start = NowNs();
+        while (NowNs() - hold_start < kWriterHoldNs) { /* Spin. */ }
+        release_time_ = NowNs();
+        ASSERT_EQ(pthread_rwlock_unlock(&rwlock_), 0);
+        while (acks_ < nreaders_ && !*stop)
+          sched_yield();
+        stats->ops++;
+      }
+      return;
+    }
+    int seen = 0;
+    while (!*stop) {
+      if (round_ == seen) {
+        sched_yield();
+        continue;
+      }
+      seen = round_;
+      uint64_t start = NowNs();
+      ASSERT_EQ(pthread_rwlock_rdlock(&rwlock_), 0);
+      uint64_t acquired = NowNs();
+      stats->wait.Add(acquired - start);
+      stats->handoff.Add(acquired - release_time_);
+      ASSERT_EQ(pthread_rwlock_unlock(&rwlock_), 0);
+      __sync_fetch_and_add(&acks_, 1);
+      stats->ops++;
+    }
+  }
+
+  virtual int FirstPeerThread() { return 1; }
+ private:
+  pthread_rwlock_t rwlock_;
+  int nreaders_;
+  volatile int round_;
+  volatile int acks_;
+  volatile uint64_t release_time_;
+};
+
+// Thread 0 broadcasts a condvar that all the other threads wait on, and
+// waits for every waiter to acknowledge before the next round.  Handoff
+// latency is the time from the broadcast until each waiter woke up.
+class TestCondvarBroadcast : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    ASSERT_EQ(pthread_mutex_init(&mutex_, NULL), 0);
+    ASSERT_EQ(pthread_cond_init(&wake_cond_, NULL), 0);
+    ASSERT_EQ(pthread_cond_init(&ack_cond_, NULL), 0);
+    nwaiters_ = nthreads - 1;
+    generation_ = 0;
+    acks_ = 0;
+    broadcast_time_ = 0;
+    stopping_ = false;
+  }
+
+  virtual void Teardown() {
+    ASSERT_EQ(pthread_cond_destroy(&ack_cond_), 0);
+    ASSERT_EQ(pthread_cond_destroy(&wake_cond_), 0);
+    ASSERT_EQ(pthread_mutex_destroy(&mutex_), 0);
+  }
+
+  // Every thread is blocked in pthread_cond_wait() most of the time, so
+  // they stop on stopping_, which WakeAll() sets under the mutex, rather
+  // than on *stop.
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    UNREFERENCED_PARAMETER(stop);
+    ASSERT_EQ(pthread_mutex_lock(&mutex_), 0);
+    if (index == 0) {
+      while (!stopping_) {
+        acks_ = 0;
+        generation_++;
+        broadcast_time_ = NowNs();
+        ASSERT_EQ(pthread_cond_broadcast(&wake_cond_), 0);
+        while (acks_ < nwaiters_ && !stopping_)
+          ASSERT_EQ(pthread_cond_wait(&ack_cond_, &mutex_), 0);
+        stats->ops++;
+      }
+    } else {
+      // Start from generation 0 rather than the current one, in case
+      // thread 0 already broadcast before this thread got the mutex.
+      int seen = 0;
+      for (;;) {
+        uint64_t start = NowNs();
+        while (generation_ == seen && !stopping_)
+          ASSERT_EQ(pthread_cond_wait(&wake_cond_, &mutex_), 0);
+        if (stopping_)
+          break;
+        uint64_t woke = NowNs();
+        stats->wait.Add(woke - start);
+        stats->handoff.Add(woke - broadcast_time_);
+        seen = generation_;
+        if (++acks_ == nwaiters_)
+          ASSERT_EQ(pthread_cond_signal(&ack_cond_), 0);
+        stats->ops++;
+      }
+    }
+    ASSERT_EQ(pthread_mutex_unlock(&mutex_), 0);
+  }
+
+  virtual void WakeAll() {
+    ASSERT_EQ(pthread_mutex_lock(&mutex_), 0);
+    stopping_ = true;
+    ASSERT_EQ(pthread_cond_broadcast(&wake_cond_), 0);
+    ASSERT_EQ(pthread_cond_broadcast(&ack_cond_), 0);
+    ASSERT_EQ(pthread_mutex_unlock(&mutex_), 0);
+  }
+
+  virtual int FirstPeerThread() { return 1; }
+ private:
+  pthread_mutex_t mutex_;
+  pthread_cond_t wake_cond_;
+  pthread_cond_t ack_cond_;
+  int nwaiters_;
+  int generation_;
+  int acks_;
+  uint64_t broadcast_time_;
+  bool stopping_;
+};
+
+// A token passed around a ring of threads: each waits on its own semaphore
+// and posts the next thread's.  Handoff latency is the post to wakeup time
+// of each hop.
+class TestSemaphoreChain : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    nthreads_ = nthreads;
+    sems_.resize(nthreads);
+    for (int i = 0; i < nthreads; i++)
+      ASSERT_EQ(sem_init(&sems_[i], 0, i == 0 ? 1 : 0), 0);
+    post_time_ = NowNs();
+  }
+
+  virtual void Teardown() {
+    for (int i = 0; i < nthreads_; i++)
+      ASSERT_EQ(sem_destroy(&sems_[i]), 0);
+  }
+
+  // Once *stop is set, each thread passes the token on one last time and
+  // exits, so the chain shuts itself down.
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    sem_t *next = &sems_[(index + 1) % nthreads_];
+    for (;;) {
+      uint64_t start = NowNs();
+      ASSERT_EQ(sem_wait(&sems_[index]), 0);
+      uint64_t woke = NowNs();
+      if (*stop) {
+        ASSERT_EQ(sem_post(next), 0);
+        break;
+      }
+      stats->wait.Add(woke - start);
+      stats->handoff.Add(woke - post_time_);
+      stats->ops++;
+      post_time_ = NowNs();
+      ASSERT_EQ(sem_post(next), 0);
+    }
+  }
+
+ private:
+  int nthreads_;
+  std::vector<sem_t> sems_;
+  volatile uint64_t post_time_;
+};
+
+// All threads but thread 0 post to one semaphore, like the ten posting
+// threads of TestSemNormalOperation, and thread 0 waits on it.  A second
+// semaphore bounds the number of outstanding posts.
+class TestSemaphoreFanIn : public ContentionTest {
+ public:
+  virtual void Setup(int nthreads) {
+    nthreads_ = nthreads;
+    ASSERT_EQ(sem_init(&items_, 0, 0), 0);
+    ASSERT_EQ(sem_init(&credits_, 0, kFanInCredits), 0);
+  }
+
+  virtual void Teardown() {
+    ASSERT_EQ(sem_destroy(&credits_), 0);
+    ASSERT_EQ(sem_destroy(&items_), 0);
+  }
+
+  virtual void RunThread(int index, ThreadStats *stats, volatile bool *stop) {
+    sem_t *wait_sem = index == 0 ? &items_ : &credits_;
+    sem_t *post_sem = index == 0 ? &credits_ : &items_;
+    while (!*stop) {
+      uint64_t start = NowNs();
+      ASSERT_EQ(sem_wait(wait_sem), 0);
+      stats->wait.Add(NowNs() - start);
+      ASSERT_EQ(sem_post(post_sem), 0);
+      stats->ops++;
+    }
+  }
+
+  virtual void WakeAll() {
+    for (int i = 0; i < nthreads_; i++) {
+      ASSERT_EQ(sem_post(&items_), 0);
+      ASSERT_EQ(sem_post(&credits_), 0);
+    }
+  }
+
+  virtual int FirstPeerThread() { return 1; }
+ private:
+  int nthreads_;
+  sem_t items_;
+  sem_t credits_;
+};
+
+struct ThreadArg {
+  ContentionTest *test;
+  int index;
+  ThreadStats *stats;
+  volatile bool *stop;
+  // Start gate shared by all threads of a run.
+  pthread_mutex_t *mutex;
+  pthread_cond_t *cond;
+  volatile bool *started;
+};
+
+void *ContentionThread(void *arg) {
+  ThreadArg *thread_arg = (ThreadArg *) arg;
+  ASSERT_EQ(pthread_mutex_lock(thread_arg->mutex), 0);
+  while (!*thread_arg->started)
+    ASSERT_EQ(pthread_cond_wait(thread_arg->cond, thread_arg->mutex), 0);
+  ASSERT_EQ(pthread_mutex_unlock(thread_arg->mutex), 0);
+  thread_arg->test->RunThread(thread_arg->index, thread_arg->stats,
+                              thread_arg->stop);
+  return NULL;
+}
+
+void RunContentionTest(const char *description, const char *test_name,
+                       ContentionTest *test, int nthreads) {
+  std::vector<ThreadStats> stats(nthreads);
+  std::vector<ThreadArg> args(nthreads);
+  std::vector<pthread_t> tids(nthreads);
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  volatile bool started = false;
+  volatile bool stop = false;
+  ASSERT_EQ(pthread_mutex_init(&mutex, NULL), 0);
+  ASSERT_EQ(pthread_cond_init(&cond, NULL), 0);
+
+  test->Setup(nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    ThreadArg arg = { test, i, &stats[i], &stop, &mutex, &cond, &started };
+    args[i] = arg;
+    ASSERT_EQ(pthread_create(&tids[i], NULL, ContentionThread, &args[i]), 0);
+  }
+
+  // Release all threads at once, let them run, then stop them.
+  ASSERT_EQ(pthread_mutex_lock(&mutex), 0);
+  started = true;
+  ASSERT_EQ(pthread_cond_broadcast(&cond), 0);
+  ASSERT_EQ(pthread_mutex_unlock(&mutex), 0);
+  uint64_t start = NowNs();
+  ASSERT_EQ(usleep(kRunTimeMicroseconds), 0);
+  stop = true;
+  test->WakeAll();
+  for (int i = 0; i < nthreads; i++)
+    ASSERT_EQ(pthread_join(tids[i], NULL), 0);
+  double elapsed = (NowNs() - start) / 1e9;
+  test->Teardown();
+  ASSERT_EQ(pthread_cond_destroy(&cond), 0);
+  ASSERT_EQ(pthread_mutex_destroy(&mutex), 0);
+
+  uint64_t total_ops = 0;
+  int first_peer = test->FirstPeerThread();
+  uint64_t min_ops = stats[first_peer].ops;
+  uint64_t max_ops = stats[first_peer].ops;
+  Histogram wait;
+  Histogram handoff;
+  for (int i = 0; i < nthreads; i++) {
+    wait.Merge(stats[i].wait);
+    handoff.Merge(stats[i].handoff);
+    if (i < first_peer)
+      continue;
+    total_ops += stats[i].ops;
+    if (stats[i].ops < min_ops)
+      min_ops = stats[i].ops;
+    if (stats[i].ops > max_ops)
+      max_ops = stats[i].ops;
+  }
+  // A thread that never got in counts as one operation, so that the
+  // ratio stays finite but still stands out.
+  double fairness = (double) max_ops / (min_ops > 0 ? min_ops : 1);
+
+  char graph[128];
+  snprintf(graph, sizeof(graph), "%s_Threads%d", test_name, nthreads);
+  printf("\n%s:\n", graph);
+  printf("  %" PRIu64 " operations in %.3f sec, per thread min %" PRIu64
+         " max %" PRIu64 "\n", total_ops, elapsed, min_ops, max_ops);
+  wait.Print("wait latency");
+  handoff.Print("handoff latency");
+  printf("RESULT %s_Throughput: %s= %.0f ops/s\n",
+         graph, description, total_ops / elapsed);
+  printf("RESULT %s_Fairness: %s= %.3f ratio\n", graph, description, fairness);
+  if (wait.Total() != 0) {
+    printf("RESULT %s_WaitLatency: %s= {%" PRIu64 ", %" PRIu64 "} ns\n",
+           graph, description, wait.Quantile(0.5), wait.Quantile(0.99));
+  }
+  if (handoff.Total() != 0) {
+    printf("RESULT %s_HandoffLatency: %s= {%" PRIu64 ", %" PRIu64 "} ns\n",
+           graph, description, handoff.Quantile(0.5), handoff.Quantile(0.99));
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *description = argc >= 2 ? argv[1] : "time";
+
+  // Turn off stdout buffering to aid debugging.
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  // Every scenario needs at least two threads to contend.
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = nprocs > 2 ? nprocs : 2;
+  std::vector<int> thread_counts;
+  for (int n = 2; n < max_threads; n *= 2)
+    thread_counts.push_back(n);
+  thread_counts.push_back(max_threads);
+
+#define RUN_TEST(test_name, class_name) \
+    for (size_t i = 0; i < thread_counts.size(); i++) { \
+      class_name test; \
+      RunContentionTest(description, test_name, &test, thread_counts[i]); \
+    }
+
+  // The latency values in the "{...}" RESULT lines are the p50 and p99
+  // histogram bucket upper bounds.
+  RUN_TEST("TestContendedMutexNormal", TestMutex<PTHREAD_MUTEX_NORMAL>);
+  RUN_TEST("TestContendedMutexRecursive", TestMutex<PTHREAD_MUTEX_RECURSIVE>);
+  RUN_TEST("TestContendedMutexErrorCheck",
+           TestMutex<PTHREAD_MUTEX_ERRORCHECK>);
+  RUN_TEST("TestContendedRwLockRead100", TestRwLockMix<100>);
+  RUN_TEST("TestContendedRwLockRead90", TestRwLockMix<90>);
+  RUN_TEST("TestContendedRwLockRead50", TestRwLockMix<50>);
+  RUN_TEST("TestRwLockReaderWakeup", TestRwLockReaderWakeup);
+  RUN_TEST("TestCondvarBroadcastFanOut", TestCondvarBroadcast);
+  RUN_TEST("TestSemaphoreChain", TestSemaphoreChain);
+  RUN_TEST("TestSemaphoreFanIn", TestSemaphoreFanIn);
+
+#undef RUN_TEST
+
+  return 0;
+}
@@ -4,39 +4,117 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "native_client/src/include/build_config.h"
+
+#if NACL_LINUX
+# include <sched.h>
+#endif
+
 #include "native_client/src/include/nacl_assert.h"
 #include "native_client/src/include/nacl_macros.h"
 #include "native_client/tests/performance/perf_test_compat_osx.h"
 #include "native_client/tests/performance/perf_test_runner.h"
 
 
+// Command line options.  Anything not starting with "--" is taken as the
+// description string, as before.
+struct RunnerOptions {
+  const char *description;
+  // CPU to pin the runner to, or -1 to leave scheduling alone.
+  int cpu;
+  // Number of passes over the tests.  Each pass calibrates, warms up and
+  // samples every test again, so the spread of the per-run medians shows
+  // the variance between runs that the samples of a single run miss.  1
+  // unless results are written for or compared with a baseline, which
+  // default to kComparisonRuns.
+  int runs;
+  // Within a run, sampling stops once the half-width of the bootstrap
+  // confidence interval of the median is within this fraction of the
+  // median...
+  double ci_target;
+  // ...or when either of these limits is reached.
+  int min_samples;
+  int max_samples;
+  double max_time;
+  // Number of single-run samples taken by PerfTestCycleCount.
+  int cycle_samples;
+  const char *json_path;
+  const char *csv_path;
+  const char *baseline_path;
+  // Relative slowdown below which a change is never reported as a
+  // regression, however consistent it is.
+  double threshold;
+};
+
+// Default number of runs when writing or comparing with a baseline.
+static const int kComparisonRuns = 5;
+
+// Samples of one test from every run, in seconds per iteration.
+struct PerfSamples {
+  std::vector<double> samples;
+  std::vector<double> run_medians;
+  // Iterations per sample in the first run.
+  int iterations;
+};
+
+// Summary statistics of a real time measurement.  All times are seconds
+// per iteration.  median is the median of the per-run medians, run_low and
+// run_high the lowest and highest of them.  The other statistics pool the
+// samples of every run.
+struct PerfResult {
+  std::string test_name;
+  double median;
+  double stddev;
+  double mad;
+  double ci_low;
+  double ci_high;
+  double run_low;
+  double run_high;
+  int runs;
+  int samples;
+  int iterations;
+};
+
+// Each sample aims to take this long, so that clock resolution and the
+// timing overhead are negligible.
+static const double kSampleTime = 0.01;  // seconds
+// Warmup ends once kWarmupWindow consecutive samples agree to within
+// kWarmupTolerance, or after kMaxWarmupTime.
+static const int kWarmupWindow = 3;
+static const double kWarmupTolerance = 0.05;
+static const double kMaxWarmupTime = 1.0;  // seconds
+// The confidence interval is recomputed every kCheckInterval samples.
+static const int kCheckInterval = 5;
+static const int kBootstrapResamples = 1000;
+static const double kConfidence = 0.95;
+
+static double GetTime() {
+  struct timespec time;
+  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &time), 0);
+  return time.tv_sec + (double) time.tv_nsec / 1e9;
+}
+
 double TimeIterations(PerfTest *test, int iterations) {
-  struct timespec start_time;
-  struct timespec end_time;
-  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &start_time), 0);
+  double start_time = GetTime();
   for (int i = 0; i < iterations; i++) {
     test->run();
   }
-  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &end_time), 0);
-  double total_time =
-      (end_time.tv_sec - start_time.tv_sec
-       + (double) (end_time.tv_nsec - start_time.tv_nsec) / 1e9);
-  // Output the raw data.
-  printf("  %.3f usec (%g sec) per iteration: %g sec for %i iterations\n",
-         total_time / iterations * 1e6,
-         total_time / iterations,
-         total_time, iterations);
-  return total_time;
+  return GetTime() - start_time;
 }
 
-int CalibrateIterationCount(PerfTest *test, double target_time,
-                            int sample_count) {
+int CalibrateIterationCount(PerfTest *test, double target_time) {
   int calibration_iterations = 100;
   double calibration_time;
   for (;;) {
@@ -48,10 +126,13 @@ int CalibrateIterationCount(PerfTest *test, double target_time,
     ASSERT_LE(calibration_iterations, INT_MAX / 10);
     calibration_iterations *= 10;
   }
+  // Output the raw data.
+  printf("  calibration: %.3f usec per iteration: %g sec for %i iterations\n",
+         calibration_time / calibration_iterations * 1e6,
+         calibration_time, calibration_iterations);
 
   double iterations_d =
-      (target_time / (calibration_time / calibration_iterations)
-       / sample_count);
+      target_time / (calibration_time / calibration_iterations);
   // Sanity checks for very fast or very slow tests.
   ASSERT_LE(iterations_d, INT_MAX);
   int iterations = iterations_d;
@@ -60,40 +141,168 @@ int CalibrateIterationCount(PerfTest *test, double target_time,
   return iterations;
 }
 
-void TimePerfTest(PerfTest *test, double *mean, double *stddev) {
-  // 'target_time' is the amount of time we aim to run this perf test
-  // for in total.
-  double target_time = 0.5;  // seconds
-  // 'sample_count' is the number of separate timings we take in order
-  // to measure the variability of the results.
-  int sample_count = 5;
-  int iterations = CalibrateIterationCount(test, target_time, sample_count);
+static double Median(std::vector<double> values) {
+  size_t mid = values.size() / 2;
+  std::nth_element(values.begin(), values.begin() + mid, values.end());
+  double median = values[mid];
+  if (values.size() % 2 == 0) {
+    median = (median + *std::max_element(values.begin(),
+                                          values.begin() + mid)) / 2;
+  }
+  return median;
+}
 
+// Median absolute deviation.  This is not scaled to estimate a standard
+// deviation.
+static double MedianAbsoluteDeviation(const std::vector<double> &values,
+                                      double median) {
+  std::vector<double> deviations;
+  for (size_t i = 0; i < values.size(); i++)
+    deviations.push_back(fabs(values[i] - median));
+  return Median(deviations);
+}
+
+static double StandardDeviation(const std::vector<double> &values) {
   double sum = 0;
   double sum_of_squares = 0;
-  for (int i = 0; i < sample_count; i++) {
-    double time = TimeIterations(test, iterations) / iterations;
-    sum += time;
-    sum_of_squares += time * time;
+  for (size_t i = 0; i < values.size(); i++) {
+    sum += values[i];
+    sum_of_squares += values[i] * values[i];
   }
-  *mean = sum / sample_count;
-  *stddev = sqrt(sum_of_squares / sample_count - *mean * *mean);
+  double mean = sum / values.size();
+  double variance = sum_of_squares / values.size() - mean * mean;
+  return variance > 0 ? sqrt(variance) : 0;
 }
 
-void PerfTestRealTime(const char *description_string, const char *test_name,
-                      PerfTest *test, double *result_mean) {
-  double mean;
-  double stddev;
+// Percentile bootstrap confidence interval of the median.  This uses its
+// own fixed-seed generator so that results do not depend on libc's rand().
+static void BootstrapMedianCI(const std::vector<double> &values,
+                              double *ci_low, double *ci_high) {
+  uint32_t seed = 12345;
+  std::vector<double> medians;
+  std::vector<double> resample(values.size());
+  for (int b = 0; b < kBootstrapResamples; b++) {
+    for (size_t i = 0; i < values.size(); i++) {
+      seed = seed * 1103515245 + 12345;
+      resample[i] = values[(seed >> 8) % values.size()];
+    }
+    medians.push_back(Median(resample));
+  }
+  std::sort(medians.begin(), medians.end());
+  double tail = (1 - kConfidence) / 2;
+  *ci_low = medians[(size_t) (tail * (medians.size() - 1))];
+  *ci_high = medians[(size_t) ((1 - tail) * (medians.size() - 1))];
+}
+
+// Run samples until the last kWarmupWindow of them are stable, so that
+// caches, branch predictors and CPU frequency have settled.
+static void WarmUp(PerfTest *test, int iterations) {
+  std::vector<double> window;
+  double start_time = GetTime();
+  int warmup_samples = 0;
+  for (;;) {
+    window.push_back(TimeIterations(test, iterations));
+    warmup_samples++;
+    if ((int) window.size() > kWarmupWindow)
+      window.erase(window.begin());
+    if ((int) window.size() == kWarmupWindow) {
+      double min = *std::min_element(window.begin(), window.end());
+      double max = *std::max_element(window.begin(), window.end());
+      if (max - min <= kWarmupTolerance * min)
+        break;
+    }
+    if (GetTime() - start_time >= kMaxWarmupTime) {
+      printf("  warmup did not stabilize within %g sec\n", kMaxWarmupTime);
+      break;
+    }
+  }
+  printf("  warmup: %i samples\n", warmup_samples);
+}
+
+// Take one run's samples of the test and add them to all_samples.
+void TimePerfTest(const RunnerOptions &options, PerfTest *test,
+                  PerfSamples *all_samples) {
+  int iterations = CalibrateIterationCount(test, kSampleTime);
+  WarmUp(test, iterations);
+
+  std::vector<double> samples;
+  double start_time = GetTime();
+  for (;;) {
+    samples.push_back(TimeIterations(test, iterations) / iterations);
+    int count = samples.size();
+    if (count < options.min_samples)
+      continue;
+    if (count >= options.max_samples ||
+        GetTime() - start_time >= options.max_time) {
+      break;
+    }
+    if (count % kCheckInterval == 0) {
+      double ci_low;
+      double ci_high;
+      BootstrapMedianCI(samples, &ci_low, &ci_high);
+      if ((ci_high - ci_low) / 2 <= options.ci_target * Median(samples))
+        break;
+    }
+  }
+
+  double median = Median(samples);
+  double ci_low;
+  double ci_high;
+  BootstrapMedianCI(samples, &ci_low, &ci_high);
+  printf("  samples: %i of %i iterations\n", (int) samples.size(),
+         iterations);
+  printf("  median: %.6f usec\n", median * 1e6);
+  printf("  %.0f%% CI: [%.6f, %.6f] usec (+/- %.2f%%)\n",
+         kConfidence * 100, ci_low * 1e6, ci_high * 1e6,
+         (ci_high - ci_low) / 2 / median * 100);
+
+  if (all_samples->run_medians.empty())
+    all_samples->iterations = iterations;
+  all_samples->run_medians.push_back(median);
+  all_samples->samples.insert(all_samples->samples.end(), samples.begin(),
+                              samples.end());
+}
+
+void PerfTestRealTime(const RunnerOptions &options, PerfTest *test,
+                      PerfSamples *samples) {
   printf("Measuring real time:\n");
-  TimePerfTest(test, &mean, &stddev);
-  printf("  mean:   %.6f usec\n", mean * 1e6);
-  printf("  stddev: %.6f usec\n", stddev * 1e6);
-  printf("  relative stddev: %.2f%%\n", stddev / mean * 100);
+  TimePerfTest(options, test, samples);
+}
+
+static void Summarize(const char *test_name, const PerfSamples &samples,
+                      PerfResult *result) {
+  result->test_name = test_name;
+  result->median = Median(samples.run_medians);
+  result->stddev = StandardDeviation(samples.samples);
+  result->mad = MedianAbsoluteDeviation(samples.samples,
+                                        Median(samples.samples));
+  BootstrapMedianCI(samples.samples, &result->ci_low, &result->ci_high);
+  result->run_low = *std::min_element(samples.run_medians.begin(),
+                                      samples.run_medians.end());
+  result->run_high = *std::max_element(samples.run_medians.begin(),
+                                       samples.run_medians.end());
+  result->runs = samples.run_medians.size();
+  result->samples = samples.samples.size();
+  result->iterations = samples.iterations;
+}
+
+static void PrintResult(const RunnerOptions &options,
+                        const PerfResult &result) {
+  printf("\n%s:\n", result.test_name.c_str());
+  printf("  median of %i runs: %.6f usec\n", result.runs,
+         result.median * 1e6);
+  printf("  run medians: [%.6f, %.6f] usec (spread %.2f%%)\n",
+         result.run_low * 1e6, result.run_high * 1e6,
+         (result.run_high - result.run_low) / result.median * 100);
+  printf("  stddev: %.6f usec\n", result.stddev * 1e6);
+  printf("  MAD:    %.6f usec\n", result.mad * 1e6);
   // Output the result in a format that Buildbot will recognise in the
   // logs and record, using the Chromium perf testing infrastructure.
   printf("RESULT %s: %s= {%.6f, %.6f} us\n",
-         test_name, description_string, mean * 1e6, stddev * 1e6);
-  *result_mean = mean;
+         result.test_name.c_str(), options.description,
+         result.median * 1e6, result.stddev * 1e6);
+  printf("RESULT %s_MAD: %s= %.6f us\n",
+         result.test_name.c_str(), options.description, result.mad * 1e6);
 }
 
 #if defined(__i386__) || defined(__x86_64__)
@@ -107,41 +316,34 @@ static INLINE uint64_t ReadTimestampCounter() {
   return (((uint64_t) edx) << 32) | eax;
 }
 
-static int CompareUint64(const void *val1, const void *val2) {
-  uint64_t i1 = *(uint64_t *) val1;
-  uint64_t i2 = *(uint64_t *) val2;
-  if (i1 == i2)
-    return 0;
-  return i1 < i2 ? -1 : 1;
-}
-
-void PerfTestCycleCount(const char *description_string, const char *test_name,
+void PerfTestCycleCount(const RunnerOptions &options, const char *test_name,
                         PerfTest *test, uint64_t *result_cycles) {
   printf("Measuring clock cycles:\n");
-  uint64_t times[101];
-  for (size_t i = 0; i < NACL_ARRAY_SIZE(times); i++) {
+  std::vector<uint64_t> times(options.cycle_samples);
+  for (size_t i = 0; i < times.size(); i++) {
     uint64_t start_time = ReadTimestampCounter();
     test->run();
     uint64_t end_time = ReadTimestampCounter();
     times[i] = end_time - start_time;
   }
+  size_t shown = std::min<size_t>(10, times.size());
 
   // We expect the first run to be slower because caches won't be
   // warm.  We print the first and slowest runs so that we can verify
   // this.
   printf("  first runs (cycles):   ");
-  for (size_t i = 0; i < 10; i++)
+  for (size_t i = 0; i < shown; i++)
     printf(" %" PRId64, times[i]);
   printf(" ...\n");
 
-  qsort(times, NACL_ARRAY_SIZE(times), sizeof(times[0]), CompareUint64);
+  std::sort(times.begin(), times.end());
 
   printf("  slowest runs (cycles):  ...");
-  for (size_t i = NACL_ARRAY_SIZE(times) - 10; i < NACL_ARRAY_SIZE(times); i++)
+  for (size_t i = times.size() - shown; i < times.size(); i++)
     printf(" %" PRId64, times[i]);
   printf("\n");
 
-  int count = NACL_ARRAY_SIZE(times) - 1;
+  int count = times.size() - 1;
   uint64_t q1 = times[count * 1 / 4];  // First quartile
   uint64_t q2 = times[count * 1 / 2];  // Median
   uint64_t q3 = times[count * 3 / 4];  // Third quartile
@@ -153,55 +355,389 @@ void PerfTestCycleCount(const char *description_string, const char *test_name,
   // The "{...}" RESULT syntax usually means standard deviation but
   // here we report the interquartile range.
   printf("RESULT %s_CycleCount: %s= {%" PRId64 ", %" PRId64 "} count\n",
-         test_name, description_string, q2, q3 - q1);
+         test_name, options.description, q2, q3 - q1);
   *result_cycles = q2;
 }
 
 #endif
 
-void RunPerfTest(const char *description_string, const char *test_name,
-                 PerfTest *test) {
-  printf("\n%s:\n", test_name);
-  double mean_time;
-  PerfTestRealTime(description_string, test_name, test, &mean_time);
+struct PerfTestEntry {
+  const char *name;
+  PerfTest *(*make)();
+  PerfSamples samples;
+};
+
+static void AddTest(std::vector<PerfTestEntry> *tests, const char *name,
+                    PerfTest *(*make)()) {
+  PerfTestEntry entry;
+  entry.name = name;
+  entry.make = make;
+  entry.samples.iterations = 0;
+  tests->push_back(entry);
+}
+
+// Runs every test once per pass, rather than each test options.runs times
+// in a row, so that the runs of a test are spread over the whole time the
+// runner takes.  The cycle counts are only measured in the first pass.
+void RunPerfTests(const RunnerOptions &options,
+                  std::vector<PerfTestEntry> *tests,
+                  std::vector<PerfResult> *results) {
+  for (int run = 0; run < options.runs; run++) {
+    for (size_t i = 0; i < tests->size(); i++) {
+      PerfTestEntry *entry = &(*tests)[i];
+      printf("\n%s (run %i of %i):\n", entry->name, run + 1, options.runs);
+      PerfTest *test = entry->make();
+      PerfTestRealTime(options, test, &entry->samples);
 #if defined(__i386__) || defined(__x86_64__)
-  uint64_t cycles;
-  PerfTestCycleCount(description_string, test_name, test, &cycles);
-  // The apparent clock speed can be used to sanity-check the results,
-  // e.g. to see whether the CPU is in power-saving mode.
-  printf("Apparent clock speed: %.0f MHz\n", cycles / mean_time / 1e6);
+      if (run == 0) {
+        uint64_t cycles;
+        PerfTestCycleCount(options, entry->name, test, &cycles);
+        // The apparent clock speed can be used to sanity-check the results,
+        // e.g. to see whether the CPU is in power-saving mode.
+        printf("Apparent clock speed: %.0f MHz\n",
+               cycles / entry->samples.run_medians.back() / 1e6);
+      }
 #endif
-  delete test;
+      delete test;
+    }
+  }
+  for (size_t i = 0; i < tests->size(); i++) {
+    PerfResult result;
+    Summarize((*tests)[i].name, (*tests)[i].samples, &result);
+    PrintResult(options, result);
+    results->push_back(result);
+  }
+}
+
+// Pin the runner to one CPU so that migrations between cores do not add
+// noise to the samples.  Only host Linux builds support this.
+static void PinToCpu(int cpu) {
+#if NACL_LINUX
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    fprintf(stderr, "Failed to pin to CPU %i\n", cpu);
+    exit(1);
+  }
+  printf("Pinned to CPU %i\n", cpu);
+#else
+  printf("CPU pinning is not supported on this platform, ignoring --cpu=%i\n",
+         cpu);
+#endif
+}
+
+static std::string JsonEscape(const char *str) {
+  std::string escaped;
+  for (const char *p = str; *p != '\0'; p++) {
+    unsigned char c = *p;
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      escaped += buf;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// The JSON file has one test object per line, so that ReadBaseline can
+// read it back without a JSON parser.
+static void WriteJson(const char *path, const RunnerOptions &options,
+                      const std::vector<PerfResult> &results) {
+  FILE *fp = fopen(path, "w");
+  ASSERT_NE(fp, NULL);
+  fprintf(fp, "{\n  \"description\": \"%s\",\n  \"unit\": \"us\",\n"
+          "  \"tests\": [\n", JsonEscape(options.description).c_str());
+  for (size_t i = 0; i < results.size(); i++) {
+    const PerfResult &r = results[i];
+    fprintf(fp, "    {\"test\": \"%s\", \"median\": %.9f, \"mad\": %.9f, "
+            "\"ci_low\": %.9f, \"ci_high\": %.9f, \"samples\": %i, "
+            "\"iterations\": %i, \"stddev\": %.9f, \"runs\": %i, "
+            "\"run_low\": %.9f, \"run_high\": %.9f}%s\n",
+            JsonEscape(r.test_name.c_str()).c_str(), r.median * 1e6,
+            r.mad * 1e6, r.ci_low * 1e6, r.ci_high * 1e6, r.samples,
+            r.iterations, r.stddev * 1e6, r.runs, r.run_low * 1e6,
+            r.run_high * 1e6, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  ASSERT_EQ(fclose(fp), 0);
+}
+
+static void WriteCsv(const char *path,
+                     const std::vector<PerfResult> &results) {
+  FILE *fp = fopen(path, "w");
+  ASSERT_NE(fp, NULL);
+  fprintf(fp, "test,median_us,mad_us,ci_low_us,ci_high_us,samples,"
+          "iterations,stddev_us,runs,run_low_us,run_high_us\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const PerfResult &r = results[i];
+    fprintf(fp, "%s,%.9f,%.9f,%.9f,%.9f,%i,%i,%.9f,%i,%.9f,%.9f\n",
+            r.test_name.c_str(), r.median * 1e6, r.mad * 1e6,
+            r.ci_low * 1e6, r.ci_high * 1e6, r.samples, r.iterations,
+            r.stddev * 1e6, r.runs, r.run_low * 1e6, r.run_high * 1e6);
+  }
+  ASSERT_EQ(fclose(fp), 0);
+}
+
+// Read a file written by WriteJson or WriteCsv.  Lines that describe no
+// test, such as the CSV header, are skipped.  Files from before --runs
+// existed have no per-run fields and are read as a single run.
+static bool ReadBaseline(const char *path, std::vector<PerfResult> *results) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return false;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char name[256];
+    PerfResult r;
+    const char *json = strstr(line, "{\"test\": ");
+    int fields;
+    if (json != NULL) {
+      fields = sscanf(json, "{\"test\": \"%255[^\"]\", \"median\": %lf, "
+                      "\"mad\": %lf, \"ci_low\": %lf, \"ci_high\": %lf, "
+                      "\"samples\": %i, \"iterations\": %i, "
+                      "\"stddev\": %lf, \"runs\": %i, \"run_low\": %lf, "
+                      "\"run_high\": %lf",
+                      name, &r.median, &r.mad, &r.ci_low, &r.ci_high,
+                      &r.samples, &r.iterations, &r.stddev, &r.runs,
+                      &r.run_low, &r.run_high);
+    } else {
+      fields = sscanf(line, "%255[^,],%lf,%lf,%lf,%lf,%i,%i,%lf,%i,%lf,%lf",
+                      name, &r.median, &r.mad, &r.ci_low, &r.ci_high,
+                      &r.samples, &r.iterations, &r.stddev, &r.runs,
+                      &r.run_low, &r.run_high);
+    }
+    if (fields < 7)
+      continue;
+    if (fields < 11) {
+      r.stddev = 0;
+      r.runs = 1;
+      r.run_low = r.median;
+      r.run_high = r.median;
+    }
+    r.test_name = name;
+    r.median /= 1e6;
+    r.stddev /= 1e6;
+    r.mad /= 1e6;
+    r.ci_low /= 1e6;
+    r.ci_high /= 1e6;
+    r.run_low /= 1e6;
+    r.run_high /= 1e6;
+    results->push_back(r);
+  }
+  fclose(fp);
+  return true;
+}
+
+// Relative spread of a result's per-run medians.
+static double RunSpread(const PerfResult &r) {
+  return (r.run_high - r.run_low) / r.median;
+}
+
+// Compare against the baseline and return the number of regressions.  The
+// confidence intervals only describe the samples within a run, and runs of
+// the same binary differ by more than that, so the decision uses the
+// per-run medians instead.  A test regresses when every one of its runs is
+// slower than every baseline run, and its median is slower by more than
+// options.threshold and by more than the run-to-run spread of either side.
+// With the default 5 runs on each side, all 5 landing above all 5 baseline
+// runs by chance has probability 1/252.
+static int CompareWithBaseline(const RunnerOptions &options,
+                               const std::vector<PerfResult> &results,
+                               const std::vector<PerfResult> &baseline) {
+  int regressions = 0;
+  printf("\nComparison with baseline %s:\n", options.baseline_path);
+  for (size_t i = 0; i < results.size(); i++) {
+    const PerfResult &r = results[i];
+    const PerfResult *base = NULL;
+    for (size_t j = 0; j < baseline.size(); j++) {
+      if (baseline[j].test_name == r.test_name)
+        base = &baseline[j];
+    }
+    if (base == NULL) {
+      printf("  %-40s not in baseline\n", r.test_name.c_str());
+      continue;
+    }
+    double change = (r.median - base->median) / base->median;
+    double min_change = std::max(options.threshold,
+                                 std::max(RunSpread(r), RunSpread(*base)));
+    const char *verdict = "no significant change";
+    if (r.run_low > base->run_high && change > min_change) {
+      verdict = "REGRESSION";
+      regressions++;
+    } else if (r.run_high < base->run_low && -change > min_change) {
+      verdict = "improvement";
+    }
+    printf("  %-40s %10.6f -> %10.6f usec (%+.2f%%): %s\n",
+           r.test_name.c_str(), base->median * 1e6, r.median * 1e6,
+           change * 100, verdict);
+  }
+  printf("%i significant regression(s)\n", regressions);
+  return regressions;
+}
+
+static void Usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [description] [--cpu=N] [--runs=N]\n"
+          "    [--ci-target=FRACTION] [--min-samples=N] [--max-samples=N]\n"
+          "    [--max-time=SECONDS] [--cycle-samples=N] [--json=FILE]\n"
+          "    [--csv=FILE] [--baseline=FILE] [--threshold=FRACTION]\n"
+          "--runs defaults to 1, or to %i with --json or --baseline, which\n"
+          "makes the run take about %i times as long.\n",
+          program, kComparisonRuns, kComparisonRuns);
+}
+
+// If arg is prefix followed by a value, parses the value in base 10 into
+// *value and returns true, with *ok set to whether the whole value is a
+// number in [min, max].  Returns false for any other arg.
+static bool ParseIntOption(const char *arg, const char *prefix, long min,
+                           long max, int *value, bool *ok) {
+  size_t len = strlen(prefix);
+  if (strncmp(arg, prefix, len) != 0)
+    return false;
+  const char *start = arg + len;
+  char *end;
+  errno = 0;
+  long parsed = strtol(start, &end, 10);
+  *ok = end != start && *end == '\0' && errno == 0 &&
+        parsed >= min && parsed <= max;
+  if (*ok)
+    *value = (int) parsed;
+  return true;
+}
+
+static bool ParseDoubleOption(const char *arg, const char *prefix,
+                              double min, double max, double *value,
+                              bool *ok) {
+  size_t len = strlen(prefix);
+  if (strncmp(arg, prefix, len) != 0)
+    return false;
+  const char *start = arg + len;
+  char *end;
+  errno = 0;
+  double parsed = strtod(start, &end);
+  // The comparisons are false for NaN, so it is rejected too.
+  *ok = end != start && *end == '\0' && errno == 0 &&
+        parsed >= min && parsed <= max;
+  if (*ok)
+    *value = parsed;
+  return true;
+}
+
+static bool ParseOptions(int argc, char **argv, RunnerOptions *options) {
+  options->description = "time";
+  options->cpu = -1;
+  // 0 until --runs is seen, so that the default can depend on the mode.
+  options->runs = 0;
+  options->ci_target = 0.01;
+  options->min_samples = 10;
+  options->max_samples = 200;
+  options->max_time = 1.0;
+  options->cycle_samples = 101;
+  options->json_path = NULL;
+  options->csv_path = NULL;
+  options->baseline_path = NULL;
+  options->threshold = 0.10;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool ok = true;
+    if (strncmp(arg, "--", 2) != 0) {
+      options->description = arg;
+    } else if (ParseIntOption(arg, "--cpu=", 0, INT_MAX, &options->cpu,
+                              &ok) ||
+               ParseIntOption(arg, "--runs=", 1, 1000, &options->runs,
+                              &ok) ||
+               ParseDoubleOption(arg, "--ci-target=", 1e-6, 1,
+                                 &options->ci_target, &ok) ||
+               ParseIntOption(arg, "--min-samples=", 1, 1000000,
+                              &options->min_samples, &ok) ||
+               ParseIntOption(arg, "--max-samples=", 1, 1000000,
+                              &options->max_samples, &ok) ||
+               ParseDoubleOption(arg, "--max-time=", 1e-3, 3600,
+                                 &options->max_time, &ok) ||
+               ParseIntOption(arg, "--cycle-samples=", 1, 1000000,
+                              &options->cycle_samples, &ok) ||
+               ParseDoubleOption(arg, "--threshold=", 0, 100,
+                                 &options->threshold, &ok)) {
+      if (!ok) {
+        fprintf(stderr, "Invalid or out of range value: %s\n", arg);
+        return false;
+      }
+    } else if (strncmp(arg, "--json=", 7) == 0) {
+      options->json_path = arg + 7;
+    } else if (strncmp(arg, "--csv=", 6) == 0) {
+      options->csv_path = arg + 6;
+    } else if (strncmp(arg, "--baseline=", 11) == 0) {
+      options->baseline_path = arg + 11;
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", arg);
+      return false;
+    }
+  }
+  if (options->runs == 0) {
+    bool comparing = options->json_path != NULL ||
+                     options->baseline_path != NULL;
+    options->runs = comparing ? kComparisonRuns : 1;
+  }
+  if (options->max_samples < options->min_samples) {
+    fprintf(stderr, "--max-samples is less than --min-samples\n");
+    return false;
+  }
+  return true;
 }
 
 int main(int argc, char **argv) {
-  const char *description_string = argc >= 2 ? argv[1] : "time";
+  RunnerOptions options;
+  if (!ParseOptions(argc, argv, &options)) {
+    Usage(argv[0]);
+    return 1;
+  }
 
   // Turn off stdout buffering to aid debugging.
   setvbuf(stdout, NULL, _IONBF, 0);
 
-#define RUN_TEST(class_name) \
+  // Read the baseline up front so that a bad path fails before the run.
+  std::vector<PerfResult> baseline;
+  if (options.baseline_path != NULL &&
+      !ReadBaseline(options.baseline_path, &baseline)) {
+    fprintf(stderr, "Failed to read baseline %s\n", options.baseline_path);
+    return 1;
+  }
+
+  if (options.cpu >= 0)
+    PinToCpu(options.cpu);
+
+  std::vector<PerfResult> results;
+  std::vector<PerfTestEntry> tests;
+
+#define ADD_TEST(tests, class_name) \
     extern PerfTest *Make##class_name(); \
-    RunPerfTest(description_string, #class_name, Make##class_name());
+    AddTest(tests, #class_name, Make##class_name);
 
-  RUN_TEST(TestNull);
+  ADD_TEST(&tests, TestNull);
 #if defined(__native_client__)
-  RUN_TEST(TestNaClSyscall);
+  ADD_TEST(&tests, TestNaClSyscall);
 #endif
 #if NACL_LINUX || NACL_OSX
-  RUN_TEST(TestHostSyscall);
+  ADD_TEST(&tests, TestHostSyscall);
 #endif
-  RUN_TEST(TestSetjmpLongjmp);
-  RUN_TEST(TestClockGetTime);
+  ADD_TEST(&tests, TestSetjmpLongjmp);
+  ADD_TEST(&tests, TestClockGetTime);
 #if !NACL_OSX
-  RUN_TEST(TestTlsVariable);
+  ADD_TEST(&tests, TestTlsVariable);
 #endif
-  RUN_TEST(TestMmapAnonymous);
-  RUN_TEST(TestAtomicIncrement);
-  RUN_TEST(TestUncontendedMutexLock);
-  RUN_TEST(TestCondvarSignalNoOp);
-  RUN_TEST(TestThreadCreateAndJoin);
-  RUN_TEST(TestThreadWakeup);
+  ADD_TEST(&tests, TestMmapAnonymous);
+  ADD_TEST(&tests, TestAtomicIncrement);
+  ADD_TEST(&tests, TestUncontendedMutexLock);
+  ADD_TEST(&tests, TestCondvarSignalNoOp);
+  ADD_TEST(&tests, TestThreadCreateAndJoin);
+  ADD_TEST(&tests, TestThreadWakeup);
+  RunPerfTests(options, &tests, &results);
 
 #if defined(__native_client__)
   // Test untrusted fault handling.  This should come last because, on
@@ -209,15 +745,26 @@ int main(int argc, char **argv) {
   // thread creation and exit.  This is because when the Windows debug
   // exception handler is attached to sel_ldr as a debugger, Windows
   // suspends the whole sel_ldr process every time a thread is created
-  // or exits.
-  RUN_TEST(TestCatchingFault);
+  // or exits.  These get their own passes, after every pass of the tests
+  // above.
+  std::vector<PerfTestEntry> fault_tests;
+  ADD_TEST(&fault_tests, TestCatchingFault);
   // Measure that overhead by running MakeTestThreadCreateAndJoin again.
-  RunPerfTest(description_string,
-              "TestThreadCreateAndJoinAfterSettingFaultHandler",
-              MakeTestThreadCreateAndJoin());
+  AddTest(&fault_tests, "TestThreadCreateAndJoinAfterSettingFaultHandler",
+          MakeTestThreadCreateAndJoin);
+  RunPerfTests(options, &fault_tests, &results);
 #endif
 
-#undef RUN_TEST
+#undef ADD_TEST
+
+  if (options.json_path != NULL)
+    WriteJson(options.json_path, options, results);
+  if (options.csv_path != NULL)
+    WriteCsv(options.csv_path, results);
+  if (options.baseline_path != NULL &&
+      CompareWithBaseline(options, results, baseline) > 0) {
+    return 1;
+  }
 
   return 0;
 }